@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,9 +10,35 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h> // FICLONE
+#include <linux/falloc.h>
+#include <linux/mempolicy.h>
+#endif
 
 #define MAX_COMPRESS_THREAD 512
+#define MIN_AUTO_BLOCK_SIZE (1 << 20)
+// --block-size limits: smaller blocks cost ratio and a CRC64 each,
+// bigger ones are allocated whole by every encoder thread and by
+// --update, and must fit a 32 bit size_t
+#define MIN_BLOCK_SIZE (64 << 10)
+#define MAX_BLOCK_SIZE (1 << 30)
+// blocks per thread the autotuner aims for
+#define AUTO_BLOCKS_PER_THREAD 4
 
 // global config
 ///////////////////////////////////////////////////
@@ -22,77 +49,1529 @@ const char * MY_ZIP_MODE = "MY_ZIP_MODE:0";
 #define MY_ZIP_MODE_LEN  13
 #define MY_ZIP_MODE_HEADER_LEN 12
 
+// archive layout: [header][xz stream][meta sections][trailer]
+// every meta section is: tag(4) + payload len(8) + payload
+// trailer is: magic(8) + stream size(8) + meta size(8) + original size(8)
+// all integers are little endian
+#define MY_ZIP_TRAILER_MAGIC "MY_ZIP_T"
+#define MY_ZIP_TRAILER_LEN 32
+#define MY_ZIP_SECTION_HEADER_LEN 12
+#define MY_ZIP_SECTION_EXTENTS "EXTS"
+#define MY_ZIP_SECTION_HASH "HASH"
+#define MY_ZIP_SECTION_BLOCKS "BLKS"
+
+#define SHA256_LEN 32
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t buf[64];
+};
+
+struct data_extent {
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct archive_info {
+	uint64_t stream_size;
+	uint64_t orig_size;
+	struct data_extent * extents;
+	uint32_t extent_cnt;
+	uint32_t extent_cap;
+	// content hash: SHA-256 of the data extents followed by the extent
+	// map and the original size, see hash_extent_map()
+	uint8_t hash[SHA256_LEN];
+	int32_t has_hash;
+	// plain SHA-256 of the file, as sha256sum prints it, only known
+	// for a dense file once it was hashed, never stored
+	uint8_t file_hash[SHA256_LEN];
+	int32_t has_file_hash;
+	// CRC64 of every block_size bytes of the data extents, these
+	// line up with the xz blocks, see --update
+	uint64_t block_size;
+	uint64_t * block_crcs;
+	uint64_t block_cnt;
+	uint64_t block_cap;
+};
+
+struct extent_cursor {
+	uint32_t idx;
+	uint64_t pos;
+};
+
+// where in the extent map an offset of the xz stream data is
+struct stream_map {
+	uint32_t idx;
+	uint64_t start; // stream offset of extent idx
+};
+
 int32_t operation_mode = 0; // 0: encode, 1: decode
 uint32_t data_offset = 0;
 int32_t verbose = 0;
 int32_t thread_cnt = -1;
 uint32_t compress_level = LZMA_PRESET_DEFAULT;
+uint64_t block_size = 0; // 0: let liblzma choose
+int32_t block_size_auto = 0;
+uint32_t encoder_timeout = 0; // ms, 0: no timeout
+uint64_t max_rate = 0; // bytes per second, 0: no limit
 // global vars
 ///////////////////////////////////////////////////
 uint64_t total_size = 0;
 uint64_t current_size = 0;
 
-//////////////////////////////////////////////////
+// tracing, see --trace
+enum trace_phase {
+	TRACE_READ = 0,
+	TRACE_CODE,
+	TRACE_HASH,
+	TRACE_HASH_WAIT, // waiting for a free hasher slot
+	TRACE_WRITE,
+	TRACE_PHASE_MAX
+};
+
+struct trace_stat {
+	uint64_t ns;
+	uint64_t bytes;
+	uint64_t calls;
+};
+
+// spans shorter than this only go to the summary
+#define TRACE_MIN_SPAN_NS 1000000ULL
+#define TRACE_COUNTER_NS 50000000ULL
+
+// Hashing runs on its own thread, fed from a small ring of buffers:
+// the main thread fills slot head while the worker hashes the slots
+// from tail up to it. head and tail only grow.
+#define HASHER_SLOTS 8
+#define HASHER_SLOT_SIZE (1 << 16)
+
+struct hasher {
+	uint8_t * buf; // HASHER_SLOTS * HASHER_SLOT_SIZE
+	size_t len[HASHER_SLOTS];
+	uint32_t head;
+	uint32_t tail;
+	int32_t stop;
+	int32_t failed;
+	struct sha256_ctx sha;
+	// per-block CRC64, see archive_info
+	struct archive_info * crc_info;
+	uint64_t crc;
+	uint64_t block_fill;
+	struct trace_stat stat;
+#ifndef _WIN32
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int32_t started;
+#endif
+};
+
+// most credit --max-rate keeps after a stall, so we never burst
+#define THROTTLE_WINDOW_NS 100000000ULL
+
+// pooled allocator for liblzma, see --hugepage
+enum hugepage_mode {
+	HUGEPAGE_OFF = 0,
+	HUGEPAGE_THP,      // madvise(MADV_HUGEPAGE)
+	HUGEPAGE_EXPLICIT  // MAP_HUGETLB, needs reserved hugepages
+};
+
+#define POOL_HUGEPAGE_SIZE (2 << 20)
+#define POOL_CHUNK_SIZE (16 << 20)
+#define POOL_ALIGN 64
+// don't split off a free block smaller than this
+#define POOL_MIN_SPLIT (sizeof(struct pool_block) + POOL_ALIGN)
+
+// every block starts with this, and it links the free list, which
+// is kept in address order so neighbours can be merged
+struct pool_block {
+	struct pool_block * next;
+	size_t size;
+	uint8_t pad[POOL_ALIGN - sizeof(void *) - sizeof(size_t)];
+};
+
+struct pool_chunk {
+	struct pool_chunk * next;
+	uint8_t * base;
+	size_t size;
+	size_t used;
+};
+
+// extraction cache, see --cache
+enum cache_mode {
+	CACHE_COPY = 0, // reflink or copy the cached file
+	CACHE_LINK,     // hardlink the cached file
+	CACHE_REPORT    // only print where the cached file is
+};
+
+int32_t trace_enabled = 0;
+FILE * trace_file = NULL;
+uint64_t trace_start_ns = 0;
+uint64_t trace_counter_ns = 0;
+int32_t trace_event_cnt = 0;
+struct trace_stat trace_stats[TRACE_PHASE_MAX];
+
+//////////////////////////////////////////////////
+
+/*
+static void
+print_progress(uint32_t current_size, uint32_t total_size)
+{
+	double progress = 0.0;
+	if(!verbose)
+		return;
+	progress = (100.0 * current_size) / total_size;
+	fprintf(stderr, "\rIn progress %.2f%%", progress);
+}
+*/
+
+// Process has done i out of n rounds,
+// and we want a bar of width w and resolution r.
+static uint64_t old_c = 0;
+static int32_t have_print_once = 0; 
+static inline void 
+print_progress(uint64_t current_size, uint64_t total_size)
+{
+	uint64_t w = 70;
+	double ratio = 0.0;
+	uint64_t   c = 0;
+	uint64_t x;
+
+    // Calculuate the ratio of complete-to-incomplete.
+	ratio = current_size/(double)total_size;
+	c     = ratio * w;
+
+	if(old_c == c && old_c != 0 ) {
+		return;
+	} else if(old_c == c && old_c == 0 && have_print_once != 0) {
+		return;
+	}
+
+	for(x = 0; x < w + 10; x ++)
+		fprintf(stderr,"\b");
+
+	have_print_once = 1;
+
+	old_c = c;
+ 
+    // Show the percentage complete.
+	fprintf(stderr, "[", ratio * 100 );
+ 
+    // Show the load bar.
+	for (x=0; x < c; x++) {
+		//if(c >=1 & x + 1)
+		fprintf(stderr, "=");
+	}
+ 
+	for (int x=c; x<w; x++)
+		fprintf(stderr, " ");
+
+	fprintf(stderr, "] %0.2f%%", ratio * 100 );
+ 
+    // ANSI Control codes to go back to the
+    // previous line and clear it.
+	//if(c != w)
+	//fprintf(stderr,"]\n\033[F\033[J");
+}
+
+static uint64_t
+now_ns()
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, cnt;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&cnt);
+	return (uint64_t)((double)cnt.QuadPart * 1000000000.0 / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static const char * trace_phase_name[TRACE_PHASE_MAX] = {
+	"read",
+	"lzma_code",
+	"hash",
+	"hash_wait",
+	"write",
+};
+
+// Start tracing. "-" only prints the summary table to stderr,
+// anything else is also a Chrome trace-event JSON file (load it
+// in chrome://tracing or ui.perfetto.dev).
+static int32_t
+trace_open(const char * path)
+{
+	if(strcmp(path, "-")) {
+		trace_file = fopen(path, "w");
+		if(NULL == trace_file) {
+			fprintf(stderr, "%s: Error opening the trace file: %s\n",
+				path, strerror(errno));
+			return 1;
+		}
+		fprintf(trace_file, "{\"traceEvents\":[\n");
+	}
+	memset(trace_stats, 0, sizeof(trace_stats));
+	trace_start_ns = trace_counter_ns = now_ns();
+	trace_enabled = 1;
+	return 0;
+}
+
+static void
+trace_event(const char * fmt_event)
+{
+	fprintf(trace_file, "%s%s", trace_event_cnt ? ",\n" : "", fmt_event);
+	trace_event_cnt ++;
+}
+
+static inline uint64_t
+trace_begin()
+{
+	return trace_enabled ? now_ns() : 0;
+}
+
+static void
+trace_span(enum trace_phase phase, uint64_t start, uint64_t end, uint64_t bytes)
+{
+	char buf[256];
+
+	snprintf(buf, sizeof(buf),
+		"{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+		"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%" PRIu64 "}}",
+		trace_phase_name[phase], (start - trace_start_ns) / 1000.0,
+		(end - start) / 1000.0, bytes);
+	trace_event(buf);
+}
+
+static inline void
+trace_end(enum trace_phase phase, uint64_t start, uint64_t bytes)
+{
+	uint64_t end;
+
+	if(!trace_enabled)
+		return;
+
+	end = now_ns();
+	trace_stats[phase].ns += end - start;
+	trace_stats[phase].bytes += bytes;
+	trace_stats[phase].calls ++;
+
+	if(NULL != trace_file && end - start >= TRACE_MIN_SPAN_NS)
+		trace_span(phase, start, end, bytes);
+}
+
+// Periodic counters of the bytes moved so far, and of the encoder
+// or decoder progress as seen by liblzma.
+static void
+trace_progress(lzma_stream * strm)
+{
+	char buf[256];
+	uint64_t now, in, out;
+
+	if(!trace_enabled || NULL == trace_file)
+		return;
+
+	now = now_ns();
+	if(now - trace_counter_ns < TRACE_COUNTER_NS)
+		return;
+	trace_counter_ns = now;
+
+	lzma_get_progress(strm, &in, &out);
+
+	snprintf(buf, sizeof(buf),
+		"{\"name\":\"bytes\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+		"\"args\":{\"read\":%" PRIu64 ",\"write\":%" PRIu64 "}}",
+		(now - trace_start_ns) / 1000.0,
+		trace_stats[TRACE_READ].bytes, trace_stats[TRACE_WRITE].bytes);
+	trace_event(buf);
+
+	snprintf(buf, sizeof(buf),
+		"{\"name\":\"lzma progress\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,"
+		"\"args\":{\"in\":%" PRIu64 ",\"out\":%" PRIu64 "}}",
+		(now - trace_start_ns) / 1000.0, in, out);
+	trace_event(buf);
+}
+
+// Print the summary table and finish the trace file.
+static void
+trace_close()
+{
+	uint64_t wall;
+	double ms;
+	int32_t i;
+
+	if(!trace_enabled)
+		return;
+	trace_enabled = 0;
+
+	wall = now_ns() - trace_start_ns;
+
+	fprintf(stderr, "%-10s %12s %16s %12s %10s %6s\n",
+		"phase", "calls", "bytes", "time(ms)", "MiB/s", "%");
+	for(i = 0; i < TRACE_PHASE_MAX; i++) {
+		ms = trace_stats[i].ns / 1000000.0;
+		fprintf(stderr, "%-10s %12" PRIu64 " %16" PRIu64 " %12.3f %10.2f %6.2f\n",
+			trace_phase_name[i], trace_stats[i].calls, trace_stats[i].bytes, ms,
+			trace_stats[i].ns ? trace_stats[i].bytes / 1048576.0
+				/ (trace_stats[i].ns / 1000000000.0) : 0.0,
+			wall ? 100.0 * trace_stats[i].ns / wall : 0.0);
+	}
+	fprintf(stderr, "%-10s %12s %16s %12.3f\n", "total", "", "", wall / 1000000.0);
+
+	if(NULL != trace_file) {
+		fprintf(trace_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+		if(fclose(trace_file)) {
+			fprintf(stderr, "Error write the trace file: %s\n", strerror(errno));
+		}
+		trace_file = NULL;
+	}
+}
+
+static void
+sleep_ns(uint64_t ns)
+{
+#ifdef _WIN32
+	Sleep((DWORD)(ns / 1000000));
+#else
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+#endif
+}
+
+// Keep the I/O at max_rate bytes per second. The budget is counted
+// from the start of the current window, and the window restarts when
+// we fall behind, so a stall never turns into a burst later.
+static void
+throttle(uint64_t bytes)
+{
+	static uint64_t start = 0;
+	static uint64_t done = 0;
+	uint64_t now, due;
+
+	if(!max_rate)
+		return;
+
+	now = now_ns();
+	if(!start)
+		start = now;
+
+	done += bytes;
+	due = start + (uint64_t)((double)done * 1000000000.0 / max_rate);
+
+	if(due > now) {
+		sleep_ns(due - now);
+	} else if(now - due > THROTTLE_WINDOW_NS) {
+		start = now;
+		done = 0;
+	}
+}
+
+#ifdef __linux__
+// Parse a cpu list like "0-3,8,10-11".
+static int32_t
+parse_cpu_list(const char * str, cpu_set_t * set)
+{
+	char * endptr;
+	unsigned long first, last;
+
+	CPU_ZERO(set);
+	while(*str != '\0' && *str != '\n') {
+		first = strtoul(str, &endptr, 10);
+		if(endptr == str)
+			return 1;
+		last = first;
+		if(*endptr == '-') {
+			str = endptr + 1;
+			last = strtoul(str, &endptr, 10);
+			if(endptr == str || last < first)
+				return 1;
+		}
+		if(last >= CPU_SETSIZE)
+			return 1;
+		for(; first <= last; first++) {
+			CPU_SET(first, set);
+		}
+		str = endptr;
+		if(*str == ',')
+			str ++;
+	}
+	return CPU_COUNT(set) ? 0 : 1;
+}
+#endif
+
+// Pin this thread to cpus, and prefer memory from numa_node. The
+// encoder threads are created later and inherit both, so their
+// buffers land on the node they run on. Without a cpu list, the
+// cpus of numa_node are used.
+static int32_t
+set_placement(const char * cpus, int32_t numa_node)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	char path[64];
+	char list[4096];
+	FILE * file;
+	unsigned long mask[16];
+
+	if(numa_node >= 0) {
+		if(numa_node >= (int32_t)(sizeof(mask) * 8)) {
+			fprintf(stderr, "invalid numa node: %d\n", numa_node);
+			return 1;
+		}
+
+		if(NULL == cpus) {
+			snprintf(path, sizeof(path),
+				"/sys/devices/system/node/node%d/cpulist", numa_node);
+			if((file = fopen(path, "r")) == NULL
+				|| fgets(list, sizeof(list), file) == NULL) {
+				fprintf(stderr, "%s: %s\n", path, strerror(errno));
+				if(NULL != file) {
+					fclose(file);
+				}
+				return 1;
+			}
+			fclose(file);
+			cpus = list;
+		}
+
+		memset(mask, 0, sizeof(mask));
+		mask[numa_node / (sizeof(unsigned long) * 8)] |=
+			1UL << (numa_node % (sizeof(unsigned long) * 8));
+		if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+			sizeof(mask) * 8) < 0) {
+			fprintf(stderr, "set numa policy error: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	if(NULL != cpus) {
+		if(parse_cpu_list(cpus, &set) != 0) {
+			fprintf(stderr, "invalid cpu list: %s\n", cpus);
+			return 1;
+		}
+		if(sched_setaffinity(0, sizeof(set), &set) < 0) {
+			fprintf(stderr, "set cpu affinity error: %s\n", strerror(errno));
+			return 1;
+		}
+		// don't start more encoder threads than we have cpus
+		if(thread_cnt < 0 || thread_cnt > CPU_COUNT(&set)) {
+			thread_cnt = CPU_COUNT(&set);
+		}
+	}
+	return 0;
+#else
+	if(NULL != cpus || numa_node >= 0) {
+		fprintf(stderr, "cpu affinity and numa placement are not supported here\n");
+		return 1;
+	}
+	return 0;
+#endif
+}
+
+#ifndef _WIN32
+// The pool maps memory in big, hugepage aligned chunks and never gives
+// it back before exit. Freed blocks go to a free list and are handed
+// out again, so liblzma's per-thread buffers are faulted in once, on
+// hugepages, and a later stream in the same process reuses them.
+// Encoder threads allocate too, hence the lock.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum hugepage_mode pool_mode = HUGEPAGE_OFF;
+static struct pool_chunk * pool_chunks = NULL;
+static struct pool_block * pool_free = NULL;
+static uint64_t pool_in_use = 0;
+static uint64_t pool_peak = 0;
+static uint64_t pool_mapped = 0;
+
+static struct pool_chunk *
+pool_map_chunk(size_t size)
+{
+	struct pool_chunk * chunk;
+	uint8_t * base = MAP_FAILED;
+	uint8_t * aligned;
+	size_t head;
+
+	size = (size + POOL_HUGEPAGE_SIZE - 1) & ~(size_t)(POOL_HUGEPAGE_SIZE - 1);
+
+	if((chunk = malloc(sizeof(*chunk))) == NULL)
+		return NULL;
+
+#ifdef MAP_HUGETLB
+	if(pool_mode == HUGEPAGE_EXPLICIT) {
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(base == MAP_FAILED) {
+			fprintf(stderr, "no reserved hugepages, using transparent hugepages\n");
+			pool_mode = HUGEPAGE_THP;
+		}
+	}
+#endif
+
+	if(base == MAP_FAILED) {
+		// map one hugepage more, to cut out a hugepage aligned range
+		base = mmap(NULL, size + POOL_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(base == MAP_FAILED) {
+			free(chunk);
+			return NULL;
+		}
+		aligned = (uint8_t *)(((uintptr_t)base + POOL_HUGEPAGE_SIZE - 1)
+			& ~(uintptr_t)(POOL_HUGEPAGE_SIZE - 1));
+		head = aligned - base;
+		if(head != 0)
+			munmap(base, head);
+		munmap(aligned + size, POOL_HUGEPAGE_SIZE - head);
+		base = aligned;
+#ifdef MADV_HUGEPAGE
+		madvise(base, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	chunk->base = base;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = pool_chunks;
+	pool_chunks = chunk;
+	pool_mapped += size;
+	return chunk;
+}
+
+// The chunk a block was cut from.
+static struct pool_chunk *
+pool_find_chunk(const struct pool_block * block)
+{
+	struct pool_chunk * chunk;
+
+	for(chunk = pool_chunks; chunk != NULL; chunk = chunk->next) {
+		if((uintptr_t)block >= (uintptr_t)chunk->base
+			&& (uintptr_t)block < (uintptr_t)chunk->base + chunk->size)
+			return chunk;
+	}
+	return NULL;
+}
+
+static void *
+pool_alloc(void * opaque, size_t nmemb, size_t size)
+{
+	struct pool_block ** pp;
+	struct pool_block * block = NULL;
+	struct pool_block * rest;
+	struct pool_chunk * chunk;
+	size_t need;
+
+	(void)opaque;
+
+	if(size != 0 && nmemb > (SIZE_MAX - 2 * POOL_ALIGN) / size)
+		return NULL;
+	need = (nmemb * size + sizeof(struct pool_block) + POOL_ALIGN - 1)
+		& ~(size_t)(POOL_ALIGN - 1);
+
+	pthread_mutex_lock(&pool_lock);
+
+	// first fit, the rest of a bigger block stays on the free list
+	for(pp = &pool_free; *pp != NULL; pp = &(*pp)->next) {
+		if((*pp)->size >= need) {
+			block = *pp;
+			if(block->size - need >= POOL_MIN_SPLIT) {
+				rest = (struct pool_block *)((uint8_t *)block + need);
+				rest->size = block->size - need;
+				rest->next = block->next;
+				block->size = need;
+				*pp = rest;
+			} else {
+				*pp = block->next;
+			}
+			break;
+		}
+	}
+
+	// then the unused end of any chunk, before mapping a new one
+	if(NULL == block) {
+		for(chunk = pool_chunks; chunk != NULL; chunk = chunk->next) {
+			if(chunk->size - chunk->used >= need)
+				break;
+		}
+		if(NULL == chunk) {
+			chunk = pool_map_chunk(need > POOL_CHUNK_SIZE ? need : POOL_CHUNK_SIZE);
+		}
+		if(NULL != chunk) {
+			block = (struct pool_block *)(chunk->base + chunk->used);
+			block->size = need;
+			chunk->used += need;
+		}
+	}
+
+	if(NULL != block) {
+		pool_in_use += block->size;
+		if(pool_in_use > pool_peak)
+			pool_peak = pool_in_use;
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+
+	return NULL != block ? (void *)(block + 1) : NULL;
+}
+
+static void
+pool_release(void * opaque, void * ptr)
+{
+	struct pool_block ** pp;
+	struct pool_block ** prev_pp = NULL;
+	struct pool_block * block;
+	struct pool_block * next;
+	struct pool_chunk * chunk;
+
+	(void)opaque;
+
+	if(NULL == ptr)
+		return;
+
+	block = (struct pool_block *)ptr - 1;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_in_use -= block->size;
+	chunk = pool_find_chunk(block);
+
+	for(pp = &pool_free; *pp != NULL && (uintptr_t)*pp < (uintptr_t)block;
+		pp = &(*pp)->next) {
+		prev_pp = pp;
+	}
+	block->next = *pp;
+	*pp = block;
+
+	// merge with the free neighbours in the same chunk
+	next = block->next;
+	if(NULL != next && (uint8_t *)block + block->size == (uint8_t *)next
+		&& (uintptr_t)next < (uintptr_t)chunk->base + chunk->size) {
+		block->size += next->size;
+		block->next = next->next;
+	}
+	if(NULL != prev_pp && (uint8_t *)*prev_pp + (*prev_pp)->size == (uint8_t *)block
+		&& (uintptr_t)*prev_pp >= (uintptr_t)chunk->base) {
+		(*prev_pp)->size += block->size;
+		(*prev_pp)->next = block->next;
+		block = *prev_pp;
+		pp = prev_pp;
+	}
+
+	// a free block at the end of the used part goes back to the chunk
+	if((uint8_t *)block + block->size == chunk->base + chunk->used) {
+		chunk->used -= block->size;
+		*pp = block->next;
+	}
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static const lzma_allocator pool_allocator = {
+	.alloc = pool_alloc,
+	.free = pool_release,
+	.opaque = NULL,
+};
+#endif
+
+// Plug the pool into strm, if --hugepage asked for it.
+static int32_t
+use_pool(lzma_stream * strm, enum hugepage_mode mode)
+{
+	if(mode == HUGEPAGE_OFF)
+		return 0;
+#ifndef _WIN32
+	pool_mode = mode;
+	strm->allocator = &pool_allocator;
+	return 0;
+#else
+	fprintf(stderr, "hugepages are not supported here\n");
+	return 1;
+#endif
+}
+
+static void
+print_pool_usage()
+{
+#ifndef _WIN32
+	if(pool_mapped != 0) {
+		fprintf(stderr, "memory pool: peak %.2f MiB, mapped %.2f MiB\n",
+			pool_peak / 1048576.0, pool_mapped / 1048576.0);
+	}
+#endif
+}
+
+static void
+put_le64(uint8_t * buf, uint64_t val)
+{
+	int32_t i;
+	for(i = 0; i < 8; i++) {
+		buf[i] = (uint8_t)(val >> (i * 8));
+	}
+}
+
+static uint64_t
+get_le64(const uint8_t * buf)
+{
+	uint64_t val = 0;
+	int32_t i;
+	for(i = 7; i >= 0; i--) {
+		val = (val << 8) | buf[i];
+	}
+	return val;
+}
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_init(struct sha256_ctx * ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->count = 0;
+}
+
+static void
+sha256_block(uint32_t * state, const uint8_t * p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int32_t i;
+
+	for(i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16)
+			| ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	}
+	for(i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7]
+			+ (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3))
+			+ (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for(i = 0; i < 64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25))
+			+ ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void
+sha256_update(struct sha256_ctx * ctx, const uint8_t * data, size_t len)
+{
+	size_t used = ctx->count & 63;
+	size_t n;
+
+	ctx->count += len;
+
+	if(used != 0) {
+		n = 64 - used;
+		if(n > len)
+			n = len;
+		memcpy(ctx->buf + used, data, n);
+		data += n;
+		len -= n;
+		if(used + n < 64)
+			return;
+		sha256_block(ctx->state, ctx->buf);
+	}
+
+	while(len >= 64) {
+		sha256_block(ctx->state, data);
+		data += 64;
+		len -= 64;
+	}
+
+	memcpy(ctx->buf, data, len);
+}
+
+static void
+sha256_final(struct sha256_ctx * ctx, uint8_t * digest)
+{
+	uint64_t bits = ctx->count * 8;
+	size_t used = ctx->count & 63;
+	int32_t i;
+
+	ctx->buf[used++] = 0x80;
+	if(used > 56) {
+		memset(ctx->buf + used, 0, 64 - used);
+		sha256_block(ctx->state, ctx->buf);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, 56 - used);
+	for(i = 0; i < 8; i++) {
+		ctx->buf[56 + i] = (uint8_t)(bits >> (56 - i * 8));
+	}
+	sha256_block(ctx->state, ctx->buf);
+
+	for(i = 0; i < 32; i++) {
+		digest[i] = (uint8_t)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+	}
+}
+
+// The content hash covers the data extents, as they are fed to the
+// encoder, followed by the extent map and the original size. Holes
+// are never hashed, so a 1 TB sparse image doesn't cost 1 TB of
+// SHA-256 for zeros it never stored.
+static void
+hash_extent_map(struct sha256_ctx * ctx, const struct archive_info * info)
+{
+	uint8_t buf[16];
+	uint32_t i;
+
+	for(i = 0; i < info->extent_cnt; i++) {
+		put_le64(buf, info->extents[i].offset);
+		put_le64(buf + 8, info->extents[i].length);
+		sha256_update(ctx, buf, sizeof(buf));
+	}
+	put_le64(buf, info->orig_size);
+	sha256_update(ctx, buf, 8);
+}
+
+// Finish the content hash of the data hashed into ctx. A dense file is
+// a single extent from 0 to the end, so before the extent map goes in
+// ctx holds the plain SHA-256 of the file, keep that too.
+static void
+finish_content_hash(struct sha256_ctx * ctx, struct archive_info * info,
+	uint8_t * hash)
+{
+	struct sha256_ctx plain;
+
+	if(info->extent_cnt == 0 ? info->orig_size == 0
+		: info->extent_cnt == 1 && info->extents[0].offset == 0
+			&& info->extents[0].length == info->orig_size) {
+		plain = *ctx;
+		sha256_final(&plain, info->file_hash);
+		info->has_file_hash = 1;
+	}
+
+	hash_extent_map(ctx, info);
+	sha256_final(ctx, hash);
+}
+
+static void
+print_hash(const char * prefix, const uint8_t * hash)
+{
+	int32_t i;
+	fprintf(stderr, "%s", prefix);
+	for(i = 0; i < SHA256_LEN; i++) {
+		fprintf(stderr, "%02x", hash[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+// The content hash differs from sha256sum even for a dense file, it
+// also covers the extent map, so name it for what it is.
+static void
+print_content_hash(const struct archive_info * info)
+{
+	print_hash("content hash (sha256 of data, extent map, size): ", info->hash);
+	if(info->has_file_hash) {
+		print_hash("file sha256: ", info->file_hash);
+	}
+}
+
+static void
+free_archive_info(struct archive_info * info)
+{
+	if(NULL != info->extents) {
+		free(info->extents);
+	}
+	if(NULL != info->block_crcs) {
+		free(info->block_crcs);
+	}
+	memset(info, 0, sizeof(*info));
+}
+
+static int32_t
+add_block_crc(struct archive_info * info, uint64_t crc)
+{
+	uint64_t * crcs;
+	uint64_t cap;
+
+	if(info->block_cnt == info->block_cap) {
+		cap = info->block_cap ? info->block_cap * 2 : 64;
+		crcs = realloc(info->block_crcs, cap * sizeof(uint64_t));
+		if(NULL == crcs) {
+			return 1;
+		}
+		info->block_crcs = crcs;
+		info->block_cap = cap;
+	}
+
+	info->block_crcs[info->block_cnt ++] = crc;
+	return 0;
+}
+
+static void
+hasher_update(struct hasher * h, const uint8_t * buf, size_t len)
+{
+	uint64_t t = trace_begin();
+	uint64_t crc_size;
+	size_t n;
+
+	sha256_update(&h->sha, buf, len);
+
+	for(n = len; NULL != h->crc_info && !h->failed && n > 0; ) {
+		crc_size = h->crc_info->block_size - h->block_fill;
+		if(crc_size > n)
+			crc_size = n;
+		h->crc = lzma_crc64(buf, crc_size, h->crc);
+		h->block_fill += crc_size;
+		buf += crc_size;
+		n -= crc_size;
+		if(h->block_fill == h->crc_info->block_size) {
+			if(add_block_crc(h->crc_info, h->crc) != 0)
+				h->failed = 1;
+			h->crc = 0;
+			h->block_fill = 0;
+		}
+	}
+
+	// the worker can't write trace spans, it only adds to the summary
+	if(t) {
+		h->stat.ns += now_ns() - t;
+		h->stat.bytes += len;
+		h->stat.calls ++;
+	}
+}
+
+#ifndef _WIN32
+static void *
+hasher_thread(void * arg)
+{
+	struct hasher * h = arg;
+	uint32_t slot;
+
+	pthread_mutex_lock(&h->lock);
+	while(true) {
+		while(h->tail == h->head && !h->stop)
+			pthread_cond_wait(&h->cond, &h->lock);
+		if(h->tail == h->head)
+			break;
+		slot = h->tail % HASHER_SLOTS;
+		pthread_mutex_unlock(&h->lock);
+
+		hasher_update(h, h->buf + (size_t)slot * HASHER_SLOT_SIZE, h->len[slot]);
+
+		pthread_mutex_lock(&h->lock);
+		h->tail ++;
+		pthread_cond_signal(&h->cond);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return NULL;
+}
+#endif
+
+// Start hashing. With crc_info the per-block CRC64s are added to it
+// as well. If no thread can be started we hash in hasher_submit().
+static int32_t
+hasher_start(struct hasher * h, struct archive_info * crc_info)
+{
+	memset(h, 0, sizeof(*h));
+	h->buf = malloc((size_t)HASHER_SLOTS * HASHER_SLOT_SIZE);
+	if(NULL == h->buf) {
+		return 1;
+	}
+	sha256_init(&h->sha);
+	h->crc_info = crc_info;
+
+#ifndef _WIN32
+	if(pthread_mutex_init(&h->lock, NULL) == 0
+		&& pthread_cond_init(&h->cond, NULL) == 0
+		&& pthread_create(&h->thread, NULL, hasher_thread, h) == 0) {
+		h->started = 1;
+	}
+#endif
+	return 0;
+}
+
+// The buffer to fill next, HASHER_SLOT_SIZE bytes. Waits while the
+// worker is a whole ring behind.
+static uint8_t *
+hasher_slot(struct hasher * h)
+{
+#ifndef _WIN32
+	uint64_t t;
+
+	if(h->started) {
+		t = trace_begin();
+		pthread_mutex_lock(&h->lock);
+		while(h->head - h->tail == HASHER_SLOTS)
+			pthread_cond_wait(&h->cond, &h->lock);
+		pthread_mutex_unlock(&h->lock);
+		trace_end(TRACE_HASH_WAIT, t, 0);
+	}
+#endif
+	return h->buf + (size_t)(h->head % HASHER_SLOTS) * HASHER_SLOT_SIZE;
+}
+
+// Hand the first len bytes of the last hasher_slot() to the worker.
+// The caller may keep reading the buffer, but not write it.
+static void
+hasher_submit(struct hasher * h, size_t len)
+{
+	uint32_t slot = h->head % HASHER_SLOTS;
+
+	h->len[slot] = len;
+#ifndef _WIN32
+	if(h->started) {
+		pthread_mutex_lock(&h->lock);
+		h->head ++;
+		pthread_cond_signal(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+		return;
+	}
+#endif
+	hasher_update(h, h->buf + (size_t)slot * HASHER_SLOT_SIZE, len);
+	h->head ++;
+	h->tail ++;
+}
+
+// Wait for the worker to hash everything submitted and free the ring.
+// h->sha is then ready for the extent map. Returns 1 if a block CRC
+// could not be stored.
+static int32_t
+hasher_finish(struct hasher * h)
+{
+#ifndef _WIN32
+	if(h->started) {
+		pthread_mutex_lock(&h->lock);
+		h->stop = 1;
+		pthread_cond_signal(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+		pthread_join(h->thread, NULL);
+		pthread_cond_destroy(&h->cond);
+		pthread_mutex_destroy(&h->lock);
+		h->started = 0;
+	}
+#endif
+	if(NULL != h->crc_info && !h->failed && h->block_fill != 0) {
+		if(add_block_crc(h->crc_info, h->crc) != 0)
+			h->failed = 1;
+		h->block_fill = 0;
+	}
+
+	free(h->buf);
+	h->buf = NULL;
+
+	if(trace_enabled) {
+		trace_stats[TRACE_HASH].ns += h->stat.ns;
+		trace_stats[TRACE_HASH].bytes += h->stat.bytes;
+		trace_stats[TRACE_HASH].calls += h->stat.calls;
+	}
+	return h->failed;
+}
+
+static int32_t
+add_data_extent(struct archive_info * info, uint64_t offset, uint64_t length)
+{
+	struct data_extent * extents;
+	uint32_t cap;
+
+	if(info->extent_cnt == info->extent_cap) {
+		cap = info->extent_cap ? info->extent_cap * 2 : 16;
+		extents = realloc(info->extents, cap * sizeof(struct data_extent));
+		if(NULL == extents) {
+			return 1;
+		}
+		info->extents = extents;
+		info->extent_cap = cap;
+	}
+
+	info->extents[info->extent_cnt].offset = offset;
+	info->extents[info->extent_cnt].length = length;
+	info->extent_cnt ++;
+	return 0;
+}
+
+// Build the data extent map of the input file, holes are left out
+// and are recreated by the decompressor. Input that is not a regular
+// file (or a platform without SEEK_DATA) is one extent that runs up
+// to EOF, compress() trims it once EOF is seen.
+static int32_t
+get_data_extents(FILE * file, struct archive_info * info)
+{
+	struct stat st;
+
+	if(fstat(fileno(file), &st) < 0) {
+		fprintf(stderr, "get file size error: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if(!S_ISREG(st.st_mode)) {
+		info->orig_size = UINT64_MAX;
+		goto dense;
+	}
+
+	info->orig_size = st.st_size;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	{
+		int fd = fileno(file);
+		off_t data, hole = 0;
+
+		while(hole < st.st_size) {
+			data = lseek(fd, hole, SEEK_DATA);
+			if(data < 0) {
+				// ENXIO: no more data, the rest of the file is a hole
+				if(errno == ENXIO)
+					break;
+				if(errno == EINVAL || errno == EOPNOTSUPP)
+					goto dense;
+				fprintf(stderr, "seek data error: %s\n", strerror(errno));
+				return 1;
+			}
+
+			hole = lseek(fd, data, SEEK_HOLE);
+			if(hole < 0) {
+				fprintf(stderr, "seek hole error: %s\n", strerror(errno));
+				return 1;
+			}
+			if(hole > st.st_size)
+				hole = st.st_size;
+
+			if(add_data_extent(info, data, hole - data) != 0) {
+				fprintf(stderr, "malloc error\n");
+				return 1;
+			}
+		}
+
+		if(lseek(fd, 0, SEEK_SET) < 0) {
+			fprintf(stderr, "seek error: %s\n", strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+#endif
+
+dense:
+	info->extent_cnt = 0;
+	if(info->orig_size != 0 && add_data_extent(info, 0, info->orig_size) != 0) {
+		fprintf(stderr, "malloc error\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int32_t
+write_section(FILE * outfile, const char * tag,
+	const uint8_t * payload, uint64_t len)
+{
+	uint8_t head[MY_ZIP_SECTION_HEADER_LEN];
+
+	memcpy(head, tag, 4);
+	put_le64(head + 4, len);
+
+	if(fwrite(head, 1, sizeof(head), outfile) != sizeof(head))
+		return 1;
+	if(len != 0 && fwrite(payload, 1, len, outfile) != len)
+		return 1;
+	return 0;
+}
+
+// Append the meta sections and the trailer after the xz stream.
+static int32_t
+write_archive_meta(FILE * outfile, const struct archive_info * info)
+{
+	uint8_t trailer[MY_ZIP_TRAILER_LEN];
+	uint8_t * payload = NULL;
+	uint64_t len, meta_size = 0;
+	uint64_t i;
+
+	len = 8 + (uint64_t)info->extent_cnt * 16;
+	if((payload = malloc(len)) == NULL) {
+		errno = ENOMEM;
+		return 1;
+	}
+	put_le64(payload, info->extent_cnt);
+	for(i = 0; i < info->extent_cnt; i++) {
+		put_le64(payload + 8 + i * 16, info->extents[i].offset);
+		put_le64(payload + 16 + i * 16, info->extents[i].length);
+	}
+	if(write_section(outfile, MY_ZIP_SECTION_EXTENTS, payload, len) != 0) {
+		free(payload);
+		return 1;
+	}
+	free(payload);
+	meta_size += MY_ZIP_SECTION_HEADER_LEN + len;
+
+	if(write_section(outfile, MY_ZIP_SECTION_HASH, info->hash, SHA256_LEN) != 0)
+		return 1;
+	meta_size += MY_ZIP_SECTION_HEADER_LEN + SHA256_LEN;
+
+	len = 16 + info->block_cnt * 8;
+	if((payload = malloc(len)) == NULL) {
+		errno = ENOMEM;
+		return 1;
+	}
+	put_le64(payload, info->block_size);
+	put_le64(payload + 8, info->block_cnt);
+	for(i = 0; i < info->block_cnt; i++) {
+		put_le64(payload + 16 + i * 8, info->block_crcs[i]);
+	}
+	if(write_section(outfile, MY_ZIP_SECTION_BLOCKS, payload, len) != 0) {
+		free(payload);
+		return 1;
+	}
+	free(payload);
+	meta_size += MY_ZIP_SECTION_HEADER_LEN + len;
+
+	memcpy(trailer, MY_ZIP_TRAILER_MAGIC, 8);
+	put_le64(trailer + 8, info->stream_size);
+	put_le64(trailer + 16, meta_size);
+	put_le64(trailer + 24, info->orig_size);
+
+	if(fwrite(trailer, 1, sizeof(trailer), outfile) != sizeof(trailer))
+		return 1;
+	return 0;
+}
+
+static int32_t
+parse_extents(struct archive_info * info, const uint8_t * payload, uint64_t len)
+{
+	uint64_t cnt, i, offset, length, end = 0;
+
+	if(len < 8)
+		return 1;
+	cnt = get_le64(payload);
+	if(cnt > (len - 8) / 16 || len != 8 + cnt * 16)
+		return 1;
+
+	info->extent_cnt = 0;
+	for(i = 0; i < cnt; i++) {
+		offset = get_le64(payload + 8 + i * 16);
+		length = get_le64(payload + 16 + i * 16);
+		if(offset < end || length > info->orig_size
+			|| offset > info->orig_size - length)
+			return 1;
+		if(add_data_extent(info, offset, length) != 0)
+			return 1;
+		end = offset + length;
+	}
+	return 0;
+}
+
+static int32_t
+parse_blocks(struct archive_info * info, const uint8_t * payload, uint64_t len)
+{
+	uint64_t cnt, i;
+
+	if(len < 16)
+		return 1;
+	info->block_size = get_le64(payload);
+	cnt = get_le64(payload + 8);
+	if(info->block_size == 0 || cnt > (len - 16) / 8 || len != 16 + cnt * 8)
+		return 1;
+
+	info->block_cnt = 0;
+	for(i = 0; i < cnt; i++) {
+		if(add_block_crc(info, get_le64(payload + 16 + i * 8)) != 0)
+			return 1;
+	}
+	return 0;
+}
 
-/*
-static void
-print_progress(uint32_t current_size, uint32_t total_size)
+// Read the trailer of the archive. Archives without a trailer are
+// one plain xz stream written as is, which is what we fall back to.
+static int32_t
+load_archive_info(FILE * infile, uint64_t file_size, struct archive_info * info)
 {
-	double progress = 0.0;
-	if(!verbose)
-		return;
-	progress = (100.0 * current_size) / total_size;
-	fprintf(stderr, "\rIn progress %.2f%%", progress);
+	uint8_t trailer[MY_ZIP_TRAILER_LEN];
+	uint8_t * meta = NULL;
+	uint8_t * p;
+	uint64_t meta_size, left, len;
+
+	memset(info, 0, sizeof(*info));
+
+	if(file_size < data_offset + MY_ZIP_TRAILER_LEN)
+		goto legacy;
+
+	if(fseeko(infile, file_size - MY_ZIP_TRAILER_LEN, SEEK_SET) < 0
+		|| fread(trailer, 1, sizeof(trailer), infile) != sizeof(trailer)) {
+		fprintf(stderr, "read trailer error: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if(memcmp(trailer, MY_ZIP_TRAILER_MAGIC, 8))
+		goto legacy;
+
+	info->stream_size = get_le64(trailer + 8);
+	meta_size = get_le64(trailer + 16);
+	info->orig_size = get_le64(trailer + 24);
+
+	if(info->stream_size > file_size - data_offset - MY_ZIP_TRAILER_LEN
+		|| meta_size != file_size - data_offset - MY_ZIP_TRAILER_LEN
+			- info->stream_size) {
+		goto corrupt;
+	}
+
+	if((meta = malloc(meta_size + 1)) == NULL) {
+		fprintf(stderr, "malloc error\n");
+		return 1;
+	}
+
+	if(fseeko(infile, data_offset + info->stream_size, SEEK_SET) < 0
+		|| fread(meta, 1, meta_size, infile) != meta_size) {
+		fprintf(stderr, "read trailer error: %s\n", strerror(errno));
+		free(meta);
+		return 1;
+	}
+
+	for(p = meta, left = meta_size; left > 0; ) {
+		if(left < MY_ZIP_SECTION_HEADER_LEN)
+			goto corrupt;
+		len = get_le64(p + 4);
+		if(len > left - MY_ZIP_SECTION_HEADER_LEN)
+			goto corrupt;
+
+		// unknown sections are skipped
+		if(!memcmp(p, MY_ZIP_SECTION_EXTENTS, 4)) {
+			if(parse_extents(info, p + MY_ZIP_SECTION_HEADER_LEN, len) != 0)
+				goto corrupt;
+		} else if(!memcmp(p, MY_ZIP_SECTION_HASH, 4)) {
+			if(len != SHA256_LEN)
+				goto corrupt;
+			memcpy(info->hash, p + MY_ZIP_SECTION_HEADER_LEN, SHA256_LEN);
+			info->has_hash = 1;
+		} else if(!memcmp(p, MY_ZIP_SECTION_BLOCKS, 4)) {
+			if(parse_blocks(info, p + MY_ZIP_SECTION_HEADER_LEN, len) != 0)
+				goto corrupt;
+		}
+
+		p += MY_ZIP_SECTION_HEADER_LEN + len;
+		left -= MY_ZIP_SECTION_HEADER_LEN + len;
+	}
+
+	free(meta);
+	return 0;
+
+legacy:
+	// one extent without end, and nothing to extend the output to
+	info->stream_size = file_size - data_offset;
+	info->orig_size = 0;
+	if(add_data_extent(info, 0, UINT64_MAX) != 0) {
+		fprintf(stderr, "malloc error\n");
+		return 1;
+	}
+	return 0;
+
+corrupt:
+	fprintf(stderr, "corrupt file trailer\n");
+	if(NULL != meta) {
+		free(meta);
+	}
+	return 1;
 }
-*/
 
-// Process has done i out of n rounds,
-// and we want a bar of width w and resolution r.
-static uint64_t old_c = 0;
-static int32_t have_print_once = 0; 
-static inline void 
-print_progress(uint64_t current_size, uint64_t total_size)
+static int32_t
+is_regular(FILE * file)
 {
-	uint64_t w = 70;
-	double ratio = 0.0;
-	uint64_t   c = 0;
-	uint64_t x;
+	struct stat st;
+	return fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+}
 
-    // Calculuate the ratio of complete-to-incomplete.
-	ratio = current_size/(double)total_size;
-	c     = ratio * w;
+// Leave a hole of len bytes in the output. Seeking past the end
+// and writing again keeps the hole sparse, on a pipe or a device
+// we have to write the zeros.
+static int32_t
+skip_hole(FILE * outfile, uint64_t len)
+{
+	static const uint8_t zero[BUFSIZ];
+	size_t n;
 
-	if(old_c == c && old_c != 0 ) {
-		return;
-	} else if(old_c == c && old_c == 0 && have_print_once != 0) {
-		return;
+	if(len == 0)
+		return 0;
+
+	if(is_regular(outfile))
+		return fseeko(outfile, len, SEEK_CUR) == 0 ? 0 : 1;
+
+	while(len > 0) {
+		n = len > sizeof(zero) ? sizeof(zero) : len;
+		if(fwrite(zero, 1, n, outfile) != n)
+			return 1;
+		len -= n;
 	}
+	return 0;
+}
 
-	for(x = 0; x < w + 10; x ++)
-		fprintf(stderr,"\b");
+// Write decoded data to the data extents it came from.
+static int32_t
+write_extents(FILE * outfile, const uint8_t * buf, size_t len,
+	const struct archive_info * info, struct extent_cursor * cur)
+{
+	const struct data_extent * ext;
+	uint64_t n;
 
-	have_print_once = 1;
+	while(len > 0) {
+		if(cur->idx >= info->extent_cnt) {
+			errno = EFBIG;
+			return 1;
+		}
 
-	old_c = c;
- 
-    // Show the percentage complete.
-	fprintf(stderr, "[", ratio * 100 );
- 
-    // Show the load bar.
-	for (x=0; x < c; x++) {
-		//if(c >=1 & x + 1)
-		fprintf(stderr, "=");
+		ext = &info->extents[cur->idx];
+		if(cur->pos < ext->offset) {
+			if(skip_hole(outfile, ext->offset - cur->pos) != 0)
+				return 1;
+			cur->pos = ext->offset;
+		}
+
+		n = ext->offset + ext->length - cur->pos;
+		if(n > len)
+			n = len;
+
+		if(fwrite(buf, 1, n, outfile) != n)
+			return 1;
+
+		cur->pos += n;
+		buf += n;
+		len -= n;
+
+		if(cur->pos == ext->offset + ext->length)
+			cur->idx ++;
 	}
- 
-	for (int x=c; x<w; x++)
-		fprintf(stderr, " ");
+	return 0;
+}
 
-	fprintf(stderr, "] %0.2f%%", ratio * 100 );
- 
-    // ANSI Control codes to go back to the
-    // previous line and clear it.
-	//if(c != w)
-	//fprintf(stderr,"]\n\033[F\033[J");
+// Recreate the trailing hole, if any.
+static int32_t
+finish_extents(FILE * outfile, const struct archive_info * info,
+	struct extent_cursor * cur)
+{
+	if(cur->pos >= info->orig_size)
+		return 0;
+
+	if(is_regular(outfile)) {
+		if(fflush(outfile) != 0
+			|| ftruncate(fileno(outfile), info->orig_size) != 0)
+			return 1;
+	} else if(skip_hole(outfile, info->orig_size - cur->pos) != 0) {
+		return 1;
+	}
+
+	cur->pos = info->orig_size;
+	return 0;
 }
 
 static int32_t
@@ -154,6 +1633,7 @@ init_decoder(lzma_stream *strm, lzma_ret * lzma_err)
 
 static int32_t
 decompress(lzma_stream *strm, FILE *infile, FILE *outfile,
+	struct archive_info * info,
 	lzma_ret * lzma_err, int32_t * filein_err, int32_t * fileout_err)
 {
 	*lzma_err = LZMA_OK;
@@ -172,25 +1652,46 @@ decompress(lzma_stream *strm, FILE *infile, FILE *outfile,
 	lzma_action action = LZMA_RUN;
 
 	uint8_t inbuf[BUFSIZ];
-	uint8_t outbuf[BUFSIZ];
+	// the output is hashed by the hasher thread while we write it
+	uint8_t * outbuf;
+	// the xz stream is followed by the meta sections and the trailer
+	uint64_t in_left = info->stream_size;
+	size_t read_size;
+	struct extent_cursor cur = { 0, 0 };
+	struct hasher hs;
+	uint8_t hash[SHA256_LEN];
+	uint64_t t;
+	size_t code_size;
+	int32_t rc;
+
+	if (hasher_start(&hs, NULL) != 0) {
+		*lzma_err = LZMA_MEM_ERROR;
+		return 1;
+	}
+	outbuf = hasher_slot(&hs);
 
 	strm->next_in = NULL;
 	strm->avail_in = 0;
 	strm->next_out = outbuf;
-	strm->avail_out = sizeof(outbuf);
+	strm->avail_out = HASHER_SLOT_SIZE;
 
 	while (true) {
-		if (strm->avail_in == 0 && !feof(infile)) {
+		if (strm->avail_in == 0 && action == LZMA_RUN) {
+			read_size = in_left < sizeof(inbuf) ? in_left : sizeof(inbuf);
+			t = trace_begin();
 			strm->next_in = inbuf;
-			strm->avail_in = fread(inbuf, 1, sizeof(inbuf),
+			strm->avail_in = fread(inbuf, 1, read_size,
 					infile);
+			trace_end(TRACE_READ, t, strm->avail_in);
+			in_left -= strm->avail_in;
 
 			current_size += strm->avail_in;
 			print_progress(current_size, total_size);
 
 			if (ferror(infile)) {
 				*filein_err = errno;
-				return 2;
+				rc = 2;
+				goto err;
 			}
 
 			// Once the end of the input file has been reached,
@@ -198,23 +1699,35 @@ decompress(lzma_stream *strm, FILE *infile, FILE *outfile,
 			// will be coming. As said before, this isn't required
 			// if the LZMA_CONATENATED flag isn't used when
 			// initializing the decoder.
-			if (feof(infile))
+			if (in_left == 0 || feof(infile))
 				action = LZMA_FINISH;
 		}
 
+		t = trace_begin();
+		code_size = strm->avail_out;
 		lzma_ret ret = lzma_code(strm, action);
+		trace_end(TRACE_CODE, t, code_size - strm->avail_out);
+		trace_progress(strm);
 
 		if (strm->avail_out == 0 || ret == LZMA_STREAM_END) {
-			size_t write_size = sizeof(outbuf) - strm->avail_out;
+			size_t write_size = HASHER_SLOT_SIZE - strm->avail_out;
 
-			if (fwrite(outbuf, 1, write_size, outfile)
-					!= write_size) {
+			// verify the content hash on the way out
+			hasher_submit(&hs, write_size);
+
+			t = trace_begin();
+			if (write_extents(outfile, outbuf, write_size,
+					info, &cur) != 0) {
 				*fileout_err = errno;
-				return 3;
+				rc = 3;
+				goto err;
 			}
+			trace_end(TRACE_WRITE, t, write_size);
+			throttle(write_size);
 
+			outbuf = hasher_slot(&hs);
 			strm->next_out = outbuf;
-			strm->avail_out = sizeof(outbuf);
+			strm->avail_out = HASHER_SLOT_SIZE;
 		}
 
 		if (ret != LZMA_OK) {
@@ -226,8 +1739,21 @@ decompress(lzma_stream *strm, FILE *infile, FILE *outfile,
 			// everything has gone well or that when you aren't
 			// getting more output it must have successfully
 			// decoded everything.
-			if (ret == LZMA_STREAM_END)
+			if (ret == LZMA_STREAM_END) {
+				if (finish_extents(outfile, info, &cur) != 0) {
+					*fileout_err = errno;
+					rc = 3;
+					goto err;
+				}
+
+				hasher_finish(&hs);
+				if (info->has_hash) {
+					finish_content_hash(&hs.sha, info, hash);
+					if (memcmp(hash, info->hash, SHA256_LEN))
+						return 4;
+				}
 				return 0;
+			}
 
 			// It's not LZMA_OK nor LZMA_STREAM_END,
 			// so it must be an error code. See lzma/base.h
@@ -241,13 +1767,458 @@ decompress(lzma_stream *strm, FILE *infile, FILE *outfile,
 
 
 			*lzma_err = ret;
+			rc = 1;
+			goto err;
+		}
+	}
+
+err:
+	hasher_finish(&hs);
+	return rc;
+}
+
+// Read or write the file ranges behind the stream data [off, off + len).
+// The blocks are visited in order, so the map only moves forward.
+// Reading past the end of the old file gives zeros, the file is
+// extended to its full size at the end.
+static int32_t
+map_io(FILE * file, uint8_t * buf, uint64_t off, uint64_t len,
+	const struct archive_info * info, struct stream_map * map, int32_t write)
+{
+	const struct data_extent * ext;
+	uint64_t skip, n;
+	size_t done;
+
+	while(len > 0) {
+		while(map->idx < info->extent_cnt
+			&& map->start + info->extents[map->idx].length <= off) {
+			map->start += info->extents[map->idx].length;
+			map->idx ++;
+		}
+		if(map->idx >= info->extent_cnt) {
+			errno = EFBIG;
+			return 1;
+		}
+
+		ext = &info->extents[map->idx];
+		skip = off - map->start;
+		n = ext->length - skip;
+		if(n > len)
+			n = len;
+
+		if(fseeko(file, ext->offset + skip, SEEK_SET) < 0)
+			return 1;
+
+		if(write) {
+			if(fwrite(buf, 1, n, file) != n)
+				return 1;
+		} else {
+			done = fread(buf, 1, n, file);
+			if(ferror(file))
+				return 1;
+			if(done < n) {
+				memset(buf + done, 0, n - done);
+				clearerr(file);
+			}
+		}
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Make [start, end) of the old file read back as zeros. Only the data
+// in that range is looked at, found with SEEK_DATA on a descriptor of
+// its own, so stdio's idea of the file offset is left alone.
+static int32_t
+clear_range(FILE * file, int fd, uint64_t start, uint64_t end, uint64_t * written)
+{
+	static const uint8_t zero[BUFSIZ];
+	uint8_t buf[BUFSIZ];
+	uint64_t pos = start, data_end = end;
+	size_t n, got;
+
+	while(pos < end) {
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		off_t data, hole;
+
+		data = lseek(fd, pos, SEEK_DATA);
+		if(data < 0) {
+			if(errno == ENXIO)
+				return 0;
+			if(errno != EINVAL && errno != EOPNOTSUPP)
+				return 1;
+			data = pos;
+			hole = end;
+		} else if((hole = lseek(fd, data, SEEK_HOLE)) < 0) {
 			return 1;
 		}
+		if((uint64_t)data >= end)
+			return 0;
+		pos = data;
+		data_end = (uint64_t)hole < end ? (uint64_t)hole : end;
+#endif
+		while(pos < data_end) {
+			n = data_end - pos > sizeof(buf) ? sizeof(buf) : data_end - pos;
+			if(fseeko(file, pos, SEEK_SET) < 0)
+				return 1;
+			got = fread(buf, 1, n, file);
+			if(ferror(file))
+				return 1;
+			if(got == 0) {
+				// past the old end of file
+				clearerr(file);
+				return 0;
+			}
+			if(memcmp(buf, zero, got)) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+				if(fflush(file) == 0 && fallocate(fileno(file),
+					FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, got) == 0) {
+					pos += got;
+					continue;
+				}
+#endif
+				if(fseeko(file, pos, SEEK_SET) < 0
+					|| fwrite(zero, 1, got, file) != got)
+					return 1;
+				*written += got;
+			}
+			pos += got;
+		}
+	}
+	return 0;
+}
+
+static int32_t
+clear_holes(FILE * file, const char * path, const struct archive_info * info,
+	uint64_t * written)
+{
+	uint64_t start = 0, end;
+	uint32_t i;
+	int fd = -1;
+	int32_t ret = 0;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	if(fflush(file) != 0 || (fd = open(path, O_RDONLY)) < 0)
+		return 1;
+#endif
+
+	for(i = 0; i <= info->extent_cnt && ret == 0; i++) {
+		end = i < info->extent_cnt ? info->extents[i].offset : info->orig_size;
+		if(end > start)
+			ret = clear_range(file, fd, start, end, written);
+		if(i < info->extent_cnt)
+			start = info->extents[i].offset + info->extents[i].length;
+	}
+
+	if(fd >= 0)
+		close(fd);
+	return ret;
+}
+
+// Load the index at the end of the xz stream, it has the offset
+// and size of every block.
+static int32_t
+load_stream_index(FILE * infile, const struct archive_info * info,
+	lzma_index ** idx, lzma_ret * lzma_err, int32_t * filein_err)
+{
+	uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+	lzma_stream_flags flags;
+	uint64_t memlimit = UINT64_MAX;
+	uint8_t * buf;
+	size_t pos = 0;
+	lzma_ret ret;
+
+	if(info->stream_size < 2 * LZMA_STREAM_HEADER_SIZE) {
+		*lzma_err = LZMA_DATA_ERROR;
+		return 1;
+	}
+
+	if(fseeko(infile, data_offset + info->stream_size - LZMA_STREAM_HEADER_SIZE,
+			SEEK_SET) < 0
+		|| fread(footer, 1, sizeof(footer), infile) != sizeof(footer)) {
+		*filein_err = ferror(infile) ? errno : EIO;
+		return 2;
+	}
+
+	ret = lzma_stream_footer_decode(&flags, footer);
+	if(ret != LZMA_OK) {
+		*lzma_err = ret;
+		return 1;
+	}
+	if(flags.backward_size > info->stream_size - 2 * LZMA_STREAM_HEADER_SIZE) {
+		*lzma_err = LZMA_DATA_ERROR;
+		return 1;
+	}
+
+	if((buf = malloc(flags.backward_size)) == NULL) {
+		*lzma_err = LZMA_MEM_ERROR;
+		return 1;
+	}
+
+	if(fseeko(infile, data_offset + info->stream_size - LZMA_STREAM_HEADER_SIZE
+			- flags.backward_size, SEEK_SET) < 0
+		|| fread(buf, 1, flags.backward_size, infile) != flags.backward_size) {
+		*filein_err = ferror(infile) ? errno : EIO;
+		free(buf);
+		return 2;
+	}
+
+	ret = lzma_index_buffer_decode(idx, &memlimit, NULL,
+		buf, &pos, flags.backward_size);
+	free(buf);
+	if(ret == LZMA_OK)
+		ret = lzma_index_stream_flags(*idx, &flags);
+	if(ret != LZMA_OK) {
+		*lzma_err = ret;
+		return 1;
+	}
+	return 0;
+}
+
+// Decode one xz block on its own.
+static int32_t
+decode_block(FILE * infile, const lzma_index_iter * iter, uint8_t * in,
+	uint8_t * out, lzma_ret * lzma_err, int32_t * filein_err)
+{
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_block block;
+	size_t in_pos, out_pos = 0;
+	lzma_ret ret;
+	uint32_t i;
+
+	if(fseeko(infile, data_offset + iter->block.compressed_file_offset,
+			SEEK_SET) < 0
+		|| fread(in, 1, iter->block.total_size, infile)
+			!= iter->block.total_size) {
+		*filein_err = ferror(infile) ? errno : EIO;
+		return 2;
+	}
+
+	memset(&block, 0, sizeof(block));
+	filters[0].id = LZMA_VLI_UNKNOWN;
+	block.version = 0;
+	block.check = iter->stream.flags->check;
+	block.filters = filters;
+	block.header_size = lzma_block_header_size_decode(in[0]);
+
+	ret = lzma_block_header_decode(&block, NULL, in);
+	if(ret == LZMA_OK) {
+		ret = lzma_block_compressed_size(&block, iter->block.unpadded_size);
+		if(ret == LZMA_OK) {
+			in_pos = block.header_size;
+			ret = lzma_block_buffer_decode(&block, NULL, in, &in_pos,
+				iter->block.total_size, out, &out_pos,
+				iter->block.uncompressed_size);
+		}
+		for(i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
+			free(filters[i].options);
+		}
+	}
+
+	if(ret == LZMA_OK && out_pos != iter->block.uncompressed_size)
+		ret = LZMA_DATA_ERROR;
+	if(ret != LZMA_OK) {
+		*lzma_err = ret;
+		return 1;
+	}
+	return 0;
+}
+
+// Bring an existing output up to date. A block whose CRC64 matches
+// the old file is left as it is, only the others are decoded and
+// written. The content hash is still checked over the whole result.
+// Returns -1 when the archive or the old file doesn't allow it, and
+// the error codes of decompress() otherwise.
+static int32_t
+update_output(FILE * infile, FILE * outfile, const char * output,
+	struct archive_info * info,
+	lzma_ret * lzma_err, int32_t * filein_err, int32_t * fileout_err)
+{
+	lzma_index * idx = NULL;
+	lzma_index_iter iter;
+	struct stream_map map = { 0, 0 };
+	struct stream_map next;
+	struct sha256_ctx sha;
+	uint8_t hash[SHA256_LEN];
+	uint8_t * in = NULL;
+	uint8_t * old = NULL;
+	uint8_t * out = NULL;
+	uint64_t in_cap = 0;
+	uint64_t i, u_size, changed = 0, written = 0;
+	struct stat st;
+	uint64_t t;
+	int32_t ret;
+
+	*lzma_err = LZMA_OK;
+	*filein_err = 0;
+	*fileout_err = 0;
+
+	if(!info->has_hash || info->block_size == 0
+		|| info->block_size > MAX_BLOCK_SIZE)
+		return -1;
+	// a hardlinked output, e.g. to a cache entry, must not be
+	// rewritten in place, the full extraction unlinks it first
+	if(fstat(fileno(outfile), &st) < 0 || !S_ISREG(st.st_mode)
+		|| st.st_nlink > 1)
+		return -1;
+
+	if((ret = load_stream_index(infile, info, &idx, lzma_err, filein_err)) != 0)
+		return ret;
+
+	// the blocks must be the ones the CRCs were taken over
+	ret = -1;
+	if(lzma_index_block_count(idx) != info->block_cnt)
+		goto out;
+	lzma_index_iter_init(&iter, idx);
+	for(i = 0; !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK); i++) {
+		if(iter.block.uncompressed_file_offset != i * info->block_size
+			|| iter.block.uncompressed_size > info->block_size
+			|| (iter.block.uncompressed_size != info->block_size
+				&& i + 1 != info->block_cnt))
+			goto out;
+		if(iter.block.total_size > in_cap)
+			in_cap = iter.block.total_size;
+	}
+
+	ret = 1;
+	*lzma_err = LZMA_MEM_ERROR;
+	if((in = malloc(in_cap + 1)) == NULL
+		|| (old = malloc(info->block_size)) == NULL
+		|| (out = malloc(info->block_size)) == NULL)
+		goto out;
+	*lzma_err = LZMA_OK;
+
+	ret = 3;
+	if(clear_holes(outfile, output, info, &written) != 0) {
+		*fileout_err = errno;
+		goto out;
+	}
+
+	sha256_init(&sha);
+	lzma_index_iter_rewind(&iter);
+	for(i = 0; !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK); i++) {
+		u_size = iter.block.uncompressed_size;
+
+		t = trace_begin();
+		next = map;
+		if(map_io(outfile, old, iter.block.uncompressed_file_offset, u_size,
+				info, &next, 0) != 0) {
+			ret = 3;
+			*fileout_err = errno;
+			goto out;
+		}
+		trace_end(TRACE_READ, t, u_size);
+
+		t = trace_begin();
+		if(lzma_crc64(old, u_size, 0) == info->block_crcs[i]) {
+			sha256_update(&sha, old, u_size);
+			trace_end(TRACE_HASH, t, u_size);
+		} else {
+			trace_end(TRACE_HASH, t, u_size);
+
+			t = trace_begin();
+			ret = decode_block(infile, &iter, in, out, lzma_err, filein_err);
+			if(ret != 0)
+				goto out;
+			trace_end(TRACE_CODE, t, u_size);
+
+			t = trace_begin();
+			sha256_update(&sha, out, u_size);
+			trace_end(TRACE_HASH, t, u_size);
+
+			t = trace_begin();
+			if(map_io(outfile, out, iter.block.uncompressed_file_offset, u_size,
+					info, &map, 1) != 0) {
+				ret = 3;
+				*fileout_err = errno;
+				goto out;
+			}
+			trace_end(TRACE_WRITE, t, u_size);
+			throttle(u_size);
+
+			changed ++;
+			written += u_size;
+		}
+		map = next;
+
+		current_size += iter.block.total_size;
+		print_progress(current_size, total_size);
+	}
+
+	ret = 3;
+	if(fflush(outfile) != 0
+		|| ftruncate(fileno(outfile), info->orig_size) != 0) {
+		*fileout_err = errno;
+		goto out;
+	}
+
+	finish_content_hash(&sha, info, hash);
+	if(memcmp(hash, info->hash, SHA256_LEN)) {
+		ret = 4;
+		goto out;
 	}
+
+	if(verbose) {
+		fprintf(stderr, "\nupdated %" PRIu64 " of %" PRIu64 " blocks, %"
+			PRIu64 " bytes written", changed, info->block_cnt, written);
+	}
+	ret = 0;
+
+out:
+	if(NULL != in) {
+		free(in);
+	}
+	if(NULL != old) {
+		free(old);
+	}
+	if(NULL != out) {
+		free(out);
+	}
+	lzma_index_end(idx, NULL);
+	return ret;
+}
+
+// The block size liblzma picks for LZMA2 when asked for zero. We pass
+// it explicitly, because the per-block hashes must know it.
+static uint64_t
+default_block_size()
+{
+	lzma_options_lzma opt;
+	uint64_t size = 3 * (uint64_t)LZMA_DICT_SIZE_DEFAULT;
+
+	if(!lzma_lzma_preset(&opt, compress_level))
+		size = 3 * (uint64_t)opt.dict_size;
+	if(size < MIN_AUTO_BLOCK_SIZE)
+		size = MIN_AUTO_BLOCK_SIZE;
+	return size;
+}
+
+// Pick a block size that gives every thread a few blocks, so small
+// inputs still keep all threads busy, while large inputs are split
+// into many independent blocks. Never go above what liblzma would
+// choose by itself (3 x dict size) and never below 1 MiB, where the
+// ratio starts to suffer.
+static uint64_t
+autotune_block_size(uint64_t data_size, uint32_t threads)
+{
+	uint64_t max_size = default_block_size();
+	uint64_t size;
+
+	size = data_size / ((uint64_t)threads * AUTO_BLOCKS_PER_THREAD);
+	size = (size + MIN_AUTO_BLOCK_SIZE - 1) & ~(uint64_t)(MIN_AUTO_BLOCK_SIZE - 1);
+
+	if(size < MIN_AUTO_BLOCK_SIZE)
+		size = MIN_AUTO_BLOCK_SIZE;
+	if(size > max_size)
+		size = max_size;
+	return size;
 }
 
 static int32_t
-init_encoder(lzma_stream *strm, lzma_ret * lzma_err)
+init_encoder(lzma_stream *strm, uint64_t data_size, lzma_ret * lzma_err)
 {
 	*lzma_err = LZMA_OK;
 	// The threaded encoder takes the options as pointer to
@@ -256,17 +2227,16 @@ init_encoder(lzma_stream *strm, lzma_ret * lzma_err)
 		// No flags are needed.
 		.flags = 0,
 
-		// Let liblzma determine a sane block size.
+		// Set below, never left to liblzma.
 		.block_size = 0,
 
-		// Use no timeout for lzma_code() calls by setting timeout
-		// to zero. That is, sometimes lzma_code() might block for
+		// With zero timeout, lzma_code() might block for
 		// a long time (from several seconds to even minutes).
 		// If this is not OK, for example due to progress indicator
 		// needing updates, specify a timeout in milliseconds here.
 		// See the documentation of lzma_mt in lzma/container.h for
 		// information how to choose a reasonable timeout.
-		.timeout = 0,
+		.timeout = encoder_timeout,
 
 		// Use the default preset (6) for LZMA2.
 		// To use a preset, filters must be set to NULL.
@@ -304,6 +2274,18 @@ init_encoder(lzma_stream *strm, lzma_ret * lzma_err)
 	// to determine if the number of threads should be reduced.
 	mt.threads = thread_cnt;
 
+	if(block_size_auto) {
+		block_size = autotune_block_size(data_size, mt.threads);
+	} else if(block_size == 0) {
+		block_size = default_block_size();
+	}
+	mt.block_size = block_size;
+
+	if(verbose) {
+		fprintf(stderr, "threads: %d, block size: %" PRIu64 "\n",
+			thread_cnt, block_size);
+	}
+
 	// Initialize the threaded encoder.
 	lzma_ret ret = lzma_stream_encoder_mt(strm, &mt);
 
@@ -317,6 +2299,7 @@ init_encoder(lzma_stream *strm, lzma_ret * lzma_err)
 
 static int32_t
 compress(lzma_stream *strm, FILE *infile, FILE *outfile,
+	struct archive_info * info,
 	lzma_ret * lzma_err, int32_t * filein_err, int32_t * fileout_err)
 {
 	*lzma_err = LZMA_OK;
@@ -325,55 +2308,135 @@ compress(lzma_stream *strm, FILE *infile, FILE *outfile,
 
 	lzma_action action = LZMA_RUN;
 
-	uint8_t inbuf[BUFSIZ];
+	// the input is hashed by the hasher thread while the encoder
+	// works on it
+	uint8_t * inbuf;
 	uint8_t outbuf[BUFSIZ];
+	// only the data extents go into the xz stream
+	struct data_extent * ext = NULL;
+	uint32_t ext_idx = 0;
+	uint64_t ext_left = 0;
+	uint64_t pos = 0;
+	size_t read_size;
+	struct hasher hs;
+	uint64_t t;
+	size_t code_size;
+	int32_t rc;
+
+	// the hasher also computes the per-block CRC64s
+	if (hasher_start(&hs, info) != 0) {
+		*lzma_err = LZMA_MEM_ERROR;
+		return 1;
+	}
 
 	strm->next_in = NULL;
 	strm->avail_in = 0;
 	strm->next_out = outbuf;
 	strm->avail_out = sizeof(outbuf);
 
+	if (info->extent_cnt == 0)
+		action = LZMA_FINISH;
+
 	while (true) {
-		if (strm->avail_in == 0 && !feof(infile)) {
+		if (strm->avail_in == 0 && action == LZMA_RUN) {
+			inbuf = hasher_slot(&hs);
+			t = trace_begin();
+			if (ext_left == 0) {
+				ext = &info->extents[ext_idx++];
+				if (ext->offset != pos
+					&& fseeko(infile, ext->offset, SEEK_SET) < 0) {
+					*filein_err = errno;
+					rc = 2;
+					goto err;
+				}
+				pos = ext->offset;
+				ext_left = ext->length;
+				current_size = pos;
+			}
+
+			read_size = ext_left < HASHER_SLOT_SIZE ? ext_left : HASHER_SLOT_SIZE;
 			strm->next_in = inbuf;
-			strm->avail_in = fread(inbuf, 1, sizeof(inbuf),
+			strm->avail_in = fread(inbuf, 1, read_size,
 					infile);
+			trace_end(TRACE_READ, t, strm->avail_in);
+			throttle(strm->avail_in);
 
+			pos += strm->avail_in;
+			ext_left -= strm->avail_in;
 			current_size += strm->avail_in;
 			print_progress(current_size, total_size);
 
 			if (ferror(infile)) {
 				*filein_err = errno;
-				return 2;
+				rc = 2;
+				goto err;
 			}
 
-			if (feof(infile))
+			hasher_submit(&hs, strm->avail_in);
+
+			// A pipe, or a file that shrank under us, ends the
+			// map right here.
+			if (feof(infile) && ext_left != 0) {
+				ext->length -= ext_left;
+				ext_left = 0;
+				info->extent_cnt = ext_idx;
+				info->orig_size = pos;
+			}
+
+			if (ext_left == 0 && ext_idx == info->extent_cnt) {
+				// a trailing hole is never read, finish the bar here
+				if (current_size < total_size) {
+					current_size = total_size;
+					print_progress(current_size, total_size);
+				}
 				action = LZMA_FINISH;
+			}
 		}
 
+		// with the threaded encoder this includes waiting
+		// for a free encoder thread
+		t = trace_begin();
+		code_size = strm->avail_in;
 		lzma_ret ret = lzma_code(strm, action);
+		trace_end(TRACE_CODE, t, code_size - strm->avail_in);
+		trace_progress(strm);
 
 		if (strm->avail_out == 0 || ret == LZMA_STREAM_END) {
 			size_t write_size = sizeof(outbuf) - strm->avail_out;
 
+			t = trace_begin();
 			if (fwrite(outbuf, 1, write_size, outfile)
 					!= write_size) {
 				*fileout_err = errno;
-				return 3;
+				rc = 3;
+				goto err;
 			}
+			trace_end(TRACE_WRITE, t, write_size);
 
 			strm->next_out = outbuf;
 			strm->avail_out = sizeof(outbuf);
 		}
 
 		if (ret != LZMA_OK) {
-			if (ret == LZMA_STREAM_END)
+			if (ret == LZMA_STREAM_END) {
+				if (hasher_finish(&hs) != 0) {
+					*lzma_err = LZMA_MEM_ERROR;
+					return 1;
+				}
+				finish_content_hash(&hs.sha, info, info->hash);
+				info->has_hash = 1;
 				return 0;
+			}
 
 			*lzma_err = ret;
-			return 1;
+			rc = 1;
+			goto err;
 		}
 	}
+
+err:
+	hasher_finish(&hs);
+	return rc;
 }
 
 static char * err_msg[] = {
@@ -511,6 +2574,13 @@ static struct option compress_options[] = {
 	{"extreme", no_argument,       0,  'e' },
 	{"verbose", no_argument,       0,  'v' },
 	{"thread",  required_argument, 0,  't' },
+	{"block-size", required_argument, 0, 'b' },
+	{"timeout", required_argument, 0,  'T' },
+	{"trace",   required_argument, 0,  'r' },
+	{"max-rate", required_argument, 0, 'M' },
+	{"cpus",    required_argument, 0,  'C' },
+	{"numa-node", required_argument, 0, 'N' },
+	{"hugepage", required_argument, 0, 'H' },
 	{"help",    no_argument,       0,  'h' },
 	{0,         0,                 0,  0   }
 };
@@ -519,10 +2589,66 @@ static const char * compress_option_desc[] = {
 "exterme compression, default off",
 "verbose mode, default off",
 "max thread count, default 8",
+"block size 64k-1g with k/m/g suffix, or auto, default 3 x dictionary size like liblzma",
+"encoder timeout in milliseconds, default 0 (no timeout)",
+"per-phase timings, - for a summary, or a Chrome trace JSON file",
+"max input read rate in bytes/s with k/m/g suffix, default no limit",
+"cpu list for all threads like 0-3,8, also caps the thread count, default all",
+"prefer memory on this numa node, and use its cpus if --cpus is not set",
+"pooled liblzma memory on thp or explicit (reserved) hugepages, default off",
 "show help",
 NULL
 };
 
+// Parse a size like 512k, 16M or 1g.
+static int32_t
+parse_size(const char * str, uint64_t * size)
+{
+	char * endptr = NULL;
+	uint64_t val;
+	uint32_t shift = 0;
+
+	// strtoull() takes a sign and wraps it around
+	if(*str < '0' || *str > '9')
+		return 1;
+
+	errno = 0;
+	val = strtoull(str, &endptr, 10);
+	if(errno != 0 || endptr == str)
+		return 1;
+
+	switch(*endptr) {
+	case 'k': case 'K': shift = 10; endptr ++; break;
+	case 'm': case 'M': shift = 20; endptr ++; break;
+	case 'g': case 'G': shift = 30; endptr ++; break;
+	}
+
+	if(*endptr != '\0' || val > (UINT64_MAX >> shift))
+		return 1;
+
+	*size = val << shift;
+	return 0;
+}
+
+// Parse a plain number that fits 32 bits, like the --timeout ms.
+static int32_t
+parse_uint32(const char * str, uint32_t * val)
+{
+	char * endptr = NULL;
+	unsigned long num;
+
+	if(*str < '0' || *str > '9')
+		return 1;
+
+	errno = 0;
+	num = strtoul(str, &endptr, 10);
+	if(errno != 0 || *endptr != '\0' || num > UINT32_MAX)
+		return 1;
+
+	*val = num;
+	return 0;
+}
+
 static void
 compress_usage(const char *prog)
 {
@@ -550,8 +2676,18 @@ compress_main(int32_t argc, char **argv)
 	FILE *infile = NULL;
 	uint8_t * header = NULL;
 	uint32_t header_len = 0;
-
-	while((opt = getopt_long(argc, argv, "l:evt:h:",
+	struct archive_info info;
+	uint64_t data_size = 0;
+	uint32_t i;
+	const char * trace_path = NULL;
+	const char * cpus = NULL;
+	int32_t numa_node = -1;
+	uint32_t node;
+	enum hugepage_mode hugepage = HUGEPAGE_OFF;
+
+	memset(&info, 0, sizeof(info));
+
+	while((opt = getopt_long(argc, argv, "l:evt:b:T:r:M:C:N:H:h:",
 		compress_options, &option_index)) != -1) {
 		switch (opt) {
 		case 'l':
@@ -571,6 +2707,51 @@ compress_main(int32_t argc, char **argv)
 			if(thread_cnt > MAX_COMPRESS_THREAD) thread_cnt = MAX_COMPRESS_THREAD;
 			if(thread_cnt < 0) thread_cnt = 1;
 			break;
+		case 'b':
+			if(!strcmp(optarg, "auto")) {
+				block_size_auto = 1;
+			} else if(parse_size(optarg, &block_size) != 0
+				|| block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) {
+				fprintf(stderr, "%s: invalid block size: %s, must be %dk to %dm\n",
+					argv[0], optarg, MIN_BLOCK_SIZE >> 10, MAX_BLOCK_SIZE >> 20);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			if(parse_uint32(optarg, &encoder_timeout) != 0) {
+				fprintf(stderr, "%s: invalid timeout: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			trace_path = optarg;
+			break;
+		case 'M':
+			if(parse_size(optarg, &max_rate) != 0) {
+				fprintf(stderr, "%s: invalid rate: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'C':
+			cpus = optarg;
+			break;
+		case 'N':
+			if(parse_uint32(optarg, &node) != 0 || node > INT32_MAX) {
+				fprintf(stderr, "%s: invalid numa node: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			numa_node = node;
+			break;
+		case 'H':
+			if(!strcmp(optarg, "thp")) {
+				hugepage = HUGEPAGE_THP;
+			} else if(!strcmp(optarg, "explicit")) {
+				hugepage = HUGEPAGE_EXPLICIT;
+			} else {
+				fprintf(stderr, "%s: invalid hugepage mode: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'h':
 			compress_usage(argv[0]);
 			exit(EXIT_SUCCESS);
@@ -586,14 +2767,21 @@ compress_main(int32_t argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	if((header = init_decompress_header(argv[0], &header_len)) == NULL) {
-		fprintf(stderr, "%s: Error init the header\n");
-		goto err;
+	if(set_placement(cpus, numa_node) != 0) {
+		exit(EXIT_FAILURE);
 	}
 
-	if(init_encoder(&strm, &lzma_err)!=0) {
-		fprintf(stderr, "%s: Error init the encoder: %s\n",
-					argv[0], lzma_strerror(lzma_err));
+	if(use_pool(&strm, hugepage) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	// last, so no early exit leaves an unterminated trace file
+	if(NULL != trace_path && trace_open(trace_path) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	if((header = init_decompress_header(argv[0], &header_len)) == NULL) {
+		fprintf(stderr, "%s: Error init the header\n");
 		goto err;
 	}
 
@@ -608,6 +2796,26 @@ compress_main(int32_t argc, char **argv)
 		goto err;
 	}
 
+	if(get_data_extents(infile, &info) != 0) {
+		fprintf(stderr, "%s: Error map the input file\n", argv[optind]);
+		goto err;
+	}
+
+	if(info.orig_size == UINT64_MAX) {
+		data_size = UINT64_MAX;
+	} else {
+		for(i = 0; i < info.extent_cnt; i++) {
+			data_size += info.extents[i].length;
+		}
+	}
+
+	if(init_encoder(&strm, data_size, &lzma_err)!=0) {
+		fprintf(stderr, "%s: Error init the encoder: %s\n",
+					argv[0], lzma_strerror(lzma_err));
+		goto err;
+	}
+	info.block_size = block_size;
+
 	outfile = fopen(argv[optind + 1], "wb");
 	if (outfile == NULL) {
 		fprintf(stderr, "%s: Error opening the output file: %s\n",
@@ -624,7 +2832,8 @@ compress_main(int32_t argc, char **argv)
 	free(header);
 	header = NULL;
 
-	ret = compress(&strm, infile, outfile, &lzma_err, &filein_err, &fileout_err);
+	ret = compress(&strm, infile, outfile, &info,
+		&lzma_err, &filein_err, &fileout_err);
 
 	fprintf(stderr, "\n");
 	if(ret != 0) {
@@ -641,7 +2850,20 @@ compress_main(int32_t argc, char **argv)
 		goto err;
 	}
 
+	if(verbose) {
+		print_content_hash(&info);
+		print_pool_usage();
+	}
+
+	info.stream_size = strm.total_out;
+	if(write_archive_meta(outfile, &info) != 0) {
+		fprintf(stderr, "%s: Error write the output file: %s\n",
+					argv[0], strerror(errno));
+		goto err;
+	}
+
 	lzma_end(&strm);
+	free_archive_info(&info);
 
 	if (fclose(infile)) {
 		fprintf(stderr, "%s: Read error: %s\n", argv[optind], strerror(errno));
@@ -654,11 +2876,14 @@ compress_main(int32_t argc, char **argv)
 		goto err;
 	}
 	outfile = NULL;
+	trace_close();
 	return EXIT_SUCCESS;
 err:
+	trace_close();
 	if(NULL != header) {
 		free(header);
 	}
+	free_archive_info(&info);
 	if(NULL != infile) {
 		fclose(infile);
 	}
@@ -684,13 +2909,361 @@ load_offset()
 	return 0;
 }
 
+// Copy src to dst. Only the data extents of the archive are copied,
+// so sparse outputs stay sparse, and a reflink is tried first.
+static int32_t
+copy_extents(const char * src, const char * dst, const struct archive_info * info)
+{
+	FILE * in = NULL;
+	FILE * out = NULL;
+	uint8_t buf[BUFSIZ];
+	uint64_t left;
+	size_t n;
+	uint32_t i;
+
+	if((in = fopen(src, "rb")) == NULL)
+		goto err;
+	if((out = fopen(dst, "wb")) == NULL)
+		goto err;
+
+#if defined(__linux__) && defined(FICLONE)
+	if(ioctl(fileno(out), FICLONE, fileno(in)) == 0)
+		goto done;
+#endif
+
+	for(i = 0; i < info->extent_cnt; i++) {
+		if(fseeko(in, info->extents[i].offset, SEEK_SET) < 0
+			|| fseeko(out, info->extents[i].offset, SEEK_SET) < 0)
+			goto err;
+		for(left = info->extents[i].length; left > 0; left -= n) {
+			n = left > sizeof(buf) ? sizeof(buf) : left;
+			if(fread(buf, 1, n, in) != n) {
+				if(!ferror(in))
+					errno = EIO;
+				goto err;
+			}
+			if(fwrite(buf, 1, n, out) != n)
+				goto err;
+		}
+	}
+
+	if(fflush(out) != 0 || ftruncate(fileno(out), info->orig_size) != 0)
+		goto err;
+
+done:
+	fclose(in);
+	in = NULL;
+	if(fclose(out)) {
+		out = NULL;
+		goto err;
+	}
+	return 0;
+err:
+	if(NULL != in) {
+		fclose(in);
+	}
+	if(NULL != out) {
+		fclose(out);
+	}
+	return 1;
+}
+
+// The cache entry of an archive is named after its content hash and
+// original size, so a truncated entry never counts as a hit.
+static char *
+cache_entry_path(const char * dir, const struct archive_info * info)
+{
+	char * path;
+	size_t len;
+	int32_t i, n;
+
+	len = strlen(dir) + 1 + SHA256_LEN * 2 + 1 + 20 + 1;
+	if((path = malloc(len)) == NULL)
+		return NULL;
+
+	n = snprintf(path, len, "%s/", dir);
+	for(i = 0; i < SHA256_LEN; i++) {
+		n += snprintf(path + n, len - n, "%02x", info->hash[i]);
+	}
+	snprintf(path + n, len - n, "-%" PRIu64, info->orig_size);
+	return path;
+}
+
+// Hash the data of the entry at the archive's extents, as extraction
+// would have hashed it, and compare with the archive's content hash.
+static int32_t
+cache_verify(const char * path, struct archive_info * info)
+{
+	FILE * file;
+	struct hasher hs;
+	uint8_t hash[SHA256_LEN];
+	uint8_t * buf;
+	uint64_t left;
+	size_t n;
+	uint32_t i;
+	int32_t ret = 1;
+
+	if((file = fopen(path, "rb")) == NULL)
+		return 1;
+	if(hasher_start(&hs, NULL) != 0) {
+		fclose(file);
+		return 1;
+	}
+
+	for(i = 0; i < info->extent_cnt; i++) {
+		if(fseeko(file, info->extents[i].offset, SEEK_SET) < 0)
+			goto out;
+		for(left = info->extents[i].length; left > 0; left -= n) {
+			n = left > HASHER_SLOT_SIZE ? HASHER_SLOT_SIZE : left;
+			buf = hasher_slot(&hs);
+			if(fread(buf, 1, n, file) != n)
+				goto out;
+			hasher_submit(&hs, n);
+		}
+	}
+	ret = 0;
+
+out:
+	hasher_finish(&hs);
+	fclose(file);
+	if(ret == 0) {
+		finish_content_hash(&hs.sha, info, hash);
+		ret = memcmp(hash, info->hash, SHA256_LEN) ? 1 : 0;
+	}
+	return ret;
+}
+
+// The stamp of a verified entry is kept next to it in "<entry>.stat".
+static char *
+cache_stamp_path(const char * path)
+{
+	char * stamp_path;
+	size_t len;
+
+	len = strlen(path) + sizeof(".stat");
+	if((stamp_path = malloc(len)) == NULL)
+		return NULL;
+	snprintf(stamp_path, len, "%s.stat", path);
+	return stamp_path;
+}
+
+// What stat() says about an entry. A write, also one through a
+// hardlink, moves mtime and ctime, so an unchanged stamp means the
+// entry is still as verified.
+static void
+cache_stamp(const struct stat * st, char * buf, size_t len)
+{
+	long mtime_ns = 0, ctime_ns = 0;
+
+#ifdef __linux__
+	mtime_ns = st->st_mtim.tv_nsec;
+	ctime_ns = st->st_ctim.tv_nsec;
+#endif
+	snprintf(buf, len, "%" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRId64 ".%09ld %" PRId64 ".%09ld\n",
+		(uint64_t)st->st_dev, (uint64_t)st->st_ino, (uint64_t)st->st_size,
+		(int64_t)st->st_mtime, mtime_ns, (int64_t)st->st_ctime, ctime_ns);
+}
+
+// Record the stamp of an entry that was just verified. Without one
+// the next hit hashes the entry again, so errors are ignored.
+static void
+cache_mark(const char * path)
+{
+	struct stat st;
+	char buf[128];
+	char * stamp_path;
+	FILE * file;
+
+	if(stat(path, &st) < 0 || (stamp_path = cache_stamp_path(path)) == NULL)
+		return;
+
+	cache_stamp(&st, buf, sizeof(buf));
+	if((file = fopen(stamp_path, "wb")) != NULL) {
+		if(fputs(buf, file) == EOF) {
+			fclose(file);
+			unlink(stamp_path);
+		} else if(fclose(file)) {
+			unlink(stamp_path);
+		}
+	}
+	free(stamp_path);
+}
+
+static int32_t
+cache_stamp_matches(const char * path, const struct stat * st)
+{
+	char buf[128];
+	char old[128];
+	char * stamp_path;
+	FILE * file;
+	size_t n = 0;
+
+	if((stamp_path = cache_stamp_path(path)) == NULL)
+		return 0;
+	if((file = fopen(stamp_path, "rb")) != NULL) {
+		n = fread(old, 1, sizeof(old) - 1, file);
+		fclose(file);
+	}
+	free(stamp_path);
+	old[n] = '\0';
+
+	cache_stamp(st, buf, sizeof(buf));
+	return n != 0 && !strcmp(buf, old);
+}
+
+// Drop a cache entry and its stamp, the entry is read only.
+static void
+cache_drop(const char * path)
+{
+	char * stamp_path;
+
+	if((stamp_path = cache_stamp_path(path)) != NULL) {
+		unlink(stamp_path);
+		free(stamp_path);
+	}
+#ifdef _WIN32
+	chmod(path, 0644);
+#endif
+	unlink(path);
+}
+
+// An entry is a hit only if it still has the archive's content hash:
+// it may have been edited, or written through a hardlink, since it
+// was stored. A matching stamp says it wasn't, one stat() instead of
+// hashing it all; without one the entry is hashed and stamped again.
+// A bad entry is dropped, the extraction replaces it.
+static int32_t
+cache_lookup(const char * path, struct archive_info * info)
+{
+	struct stat st;
+
+	if(stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return 1;
+	if((uint64_t)st.st_size == info->orig_size) {
+		if(cache_stamp_matches(path, &st))
+			return 0;
+		if(cache_verify(path, info) == 0) {
+			cache_mark(path);
+			return 0;
+		}
+	}
+
+	if(verbose) {
+		fprintf(stderr, "%s: cache entry does not match, dropping it\n", path);
+	}
+	cache_drop(path);
+	return 1;
+}
+
+// Never write through a link to a cache entry: writing the output in
+// place would change the entry too. Unlink it, the output then gets
+// an inode of its own. That's an output with the inode of cache_path,
+// or a read only link like the ones --cache-mode link leaves, also
+// of older entries. Hardlinks the user made are written in place.
+static int32_t
+unshare_output(const char * output, const char * cache_path)
+{
+	struct stat st;
+	struct stat entry;
+
+	if(stat(output, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink <= 1)
+		return 0;
+
+	if((st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0
+		&& (NULL == cache_path || stat(cache_path, &entry) < 0
+			|| entry.st_dev != st.st_dev || entry.st_ino != st.st_ino))
+		return 0;
+	return unlink(output) < 0 ? 1 : 0;
+}
+
+// Put the cached extraction at the output path.
+static int32_t
+cache_restore(const char * path, const char * output,
+	const struct archive_info * info, enum cache_mode mode)
+{
+#ifndef _WIN32
+	if(mode == CACHE_LINK) {
+		if(unlink(output) < 0 && errno != ENOENT)
+			return 1;
+		if(link(path, output) == 0) {
+			// the new link moved the entry's ctime
+			cache_mark(path);
+			return 0;
+		}
+	}
+#endif
+	if(unshare_output(output, path) != 0)
+		return 1;
+	return copy_extents(path, output, info);
+}
+
+// Add a verified extraction to the cache. A temp file and a rename
+// keep half written entries out of the cache. Entries are read only,
+// so a hardlinked output can't be edited by accident.
+static int32_t
+cache_store(const char * dir, const char * path, const char * output,
+	const struct archive_info * info)
+{
+	struct stat st;
+	char * tmp;
+	size_t len;
+
+	// nothing to cache when we extracted to a pipe or a device
+	if(stat(output, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+#ifdef _WIN32
+	mkdir(dir);
+#else
+	mkdir(dir, 0755);
+#endif
+
+	len = strlen(path) + 32;
+	if((tmp = malloc(len)) == NULL)
+		return 1;
+	snprintf(tmp, len, "%s.tmp%ld", path, (long)getpid());
+
+#ifdef _WIN32
+	// rename() doesn't replace an existing file here
+	cache_drop(path);
+#endif
+	if(copy_extents(output, tmp, info) != 0 || chmod(tmp, 0444) < 0
+		|| rename(tmp, path) < 0) {
+		cache_drop(tmp);
+		free(tmp);
+		return 1;
+	}
+	// stamped after the rename, which moves the ctime
+	cache_mark(path);
+
+	free(tmp);
+	return 0;
+}
+
 static struct option decompress_options[] = {
 	{"verbose", no_argument, 0,  'v' },
+	{"trace", required_argument, 0, 'r' },
+	{"cache", required_argument, 0, 'c' },
+	{"cache-mode", required_argument, 0, 'm' },
+	{"max-rate", required_argument, 0, 'M' },
+	{"cpus", required_argument, 0, 'C' },
+	{"numa-node", required_argument, 0, 'N' },
+	{"hugepage", required_argument, 0, 'H' },
+	{"update", no_argument, 0, 'u' },
 	{"help", no_argument,  0, 'h' },
 	{0, 0, 0,  0}
 };
 static const char * decompress_option_desc[] = {
 "verbose mode, default off",
+"per-phase timings, - for a summary, or a Chrome trace JSON file",
+"reuse verified extractions kept in this directory, default off",
+"copy (reflink or copy), link (hardlink, keep the output read only) or report, default copy",
+"max output write rate in bytes/s with k/m/g suffix, default no limit",
+"cpu list like 0-3,8, default all",
+"prefer memory on this numa node, and use its cpus if --cpus is not set",
+"pooled liblzma memory on thp or explicit (reserved) hugepages, default off",
+"only decode and rewrite the blocks that differ from the existing output, default off",
 "show help",
 NULL
 };
@@ -720,13 +3293,72 @@ decompress_main(int32_t argc, char **argv)
 	int32_t val;
     extern char *optarg;
     extern int optind, opterr, optopt;
-
-	while((opt = getopt_long(argc, argv, "vh",
-		compress_options, &option_index)) != -1) {
+	struct archive_info info;
+	const char * trace_path = NULL;
+	const char * cpus = NULL;
+	int32_t numa_node = -1;
+	uint32_t node;
+	enum hugepage_mode hugepage = HUGEPAGE_OFF;
+	const char * cache_dir = NULL;
+	enum cache_mode cache_mode = CACHE_COPY;
+	char * cache_path = NULL;
+	int32_t update = 0;
+
+	memset(&info, 0, sizeof(info));
+
+	while((opt = getopt_long(argc, argv, "vr:c:m:M:C:N:H:uh",
+		decompress_options, &option_index)) != -1) {
 		switch (opt) {
 		case 'v':
 			verbose = 1;
 			break;
+		case 'r':
+			trace_path = optarg;
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'u':
+			update = 1;
+			break;
+		case 'm':
+			if(!strcmp(optarg, "copy")) {
+				cache_mode = CACHE_COPY;
+			} else if(!strcmp(optarg, "link")) {
+				cache_mode = CACHE_LINK;
+			} else if(!strcmp(optarg, "report")) {
+				cache_mode = CACHE_REPORT;
+			} else {
+				decompress_usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'M':
+			if(parse_size(optarg, &max_rate) != 0) {
+				fprintf(stderr, "%s: invalid rate: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'C':
+			cpus = optarg;
+			break;
+		case 'N':
+			if(parse_uint32(optarg, &node) != 0 || node > INT32_MAX) {
+				fprintf(stderr, "%s: invalid numa node: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			numa_node = node;
+			break;
+		case 'H':
+			if(!strcmp(optarg, "thp")) {
+				hugepage = HUGEPAGE_THP;
+			} else if(!strcmp(optarg, "explicit")) {
+				hugepage = HUGEPAGE_EXPLICIT;
+			} else {
+				fprintf(stderr, "%s: invalid hugepage mode: %s\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'h':
 			decompress_usage(argv[0]);
 			exit(EXIT_SUCCESS);
@@ -742,6 +3374,19 @@ decompress_main(int32_t argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if(set_placement(cpus, numa_node) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	if(use_pool(&strm, hugepage) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	// last, so no early exit leaves an unterminated trace file
+	if(NULL != trace_path && trace_open(trace_path) != 0) {
+		exit(EXIT_FAILURE);
+	}
+
 	if (init_decoder(&strm, &lzma_err) != 0) {
 		fprintf(stderr, "%s: Error init the decoder: %s\n",
 					argv[0], lzma_strerror(lzma_err));
@@ -765,22 +3410,88 @@ decompress_main(int32_t argc, char **argv)
 		goto err;
 	}
 
-	total_size -= data_offset;
+	if(load_archive_info(infile, total_size, &info) != 0) {
+		fprintf(stderr, "%s: Error read the trailer from input file\n",
+					argv[0]);
+		goto err;
+	}
+
+	total_size = info.stream_size;
 
-	if(fseek(infile,data_offset,SEEK_SET) < 0) {
-		fprintf(stderr, "%s: Error seeking the input file: %s\n",
-					argv[0], strerror(errno));
+	if(NULL != cache_dir && !info.has_hash) {
+		fprintf(stderr, "%s: No content hash in the archive, cache disabled\n",
+					argv[0]);
+		cache_dir = NULL;
 	}
 
-	outfile = fopen(argv[optind], "wb");
-	if (outfile == NULL) {
-		fprintf(stderr, "%s: Error opening the output file: %s\n",
-					argv[optind], strerror(errno));
-		goto err;
+	if(NULL != cache_dir) {
+		if((cache_path = cache_entry_path(cache_dir, &info)) == NULL) {
+			fprintf(stderr, "malloc error\n");
+			goto err;
+		}
+
+		if(cache_lookup(cache_path, &info) == 0) {
+			if(cache_mode == CACHE_REPORT) {
+				printf("%s\n", cache_path);
+				goto cached;
+			}
+			if(cache_restore(cache_path, argv[optind], &info, cache_mode) == 0) {
+				if(verbose) {
+					fprintf(stderr, "%s: restored from %s\n",
+						argv[optind], cache_path);
+				}
+				goto cached;
+			}
+			fprintf(stderr, "%s: Error restore from the cache: %s\n",
+						cache_path, strerror(errno));
+		}
+	}
+
+	if(update && (outfile = fopen(argv[optind], "r+b")) != NULL) {
+		ret = update_output(infile, outfile, argv[optind], &info,
+			&lzma_err, &filein_err, &fileout_err);
+		if(ret < 0) {
+			if(verbose) {
+				fprintf(stderr, "%s: Can't update in place, extracting it all\n",
+						argv[optind]);
+			}
+		} else if(ret == 4) {
+			// a block whose CRC64 matched but whose data didn't, the
+			// archive is fine, so don't leave a half updated file
+			fprintf(stderr, "\n%s: content hash mismatch after the update, "
+				"extracting it all\n", argv[optind]);
+		}
+		if(ret < 0 || ret == 4) {
+			fclose(outfile);
+			outfile = NULL;
+			current_size = 0;
+			info.has_file_hash = 0;
+		}
 	}
 
-	// Try to decompress all files.
-	ret = decompress(&strm, infile, outfile, &lzma_err, &filein_err, &fileout_err);
+	if(NULL == outfile) {
+		if(unshare_output(argv[optind], cache_path) != 0) {
+			fprintf(stderr, "%s: Error unlink the hardlinked output file: %s\n",
+						argv[optind], strerror(errno));
+			goto err;
+		}
+
+		if(fseeko(infile,data_offset,SEEK_SET) < 0) {
+			fprintf(stderr, "%s: Error seeking the input file: %s\n",
+						argv[0], strerror(errno));
+		}
+
+		outfile = fopen(argv[optind], "wb");
+		if (outfile == NULL) {
+			fprintf(stderr, "%s: Error opening the output file: %s\n",
+						argv[optind], strerror(errno));
+			goto err;
+		}
+
+		// Try to decompress all files.
+		ret = decompress(&strm, infile, outfile, &info,
+			&lzma_err, &filein_err, &fileout_err);
+	}
 
 	fprintf(stderr, "\n");
 
@@ -791,13 +3502,23 @@ decompress_main(int32_t argc, char **argv)
 		} else if(ret == 2) {
 			fprintf(stderr, "%s: Error read the input file: %s\n",
 						argv[0], strerror(filein_err));			
-		} else {
+		} else if(ret == 3) {
 			fprintf(stderr, "%s: Error write the output file: %s\n",
 						argv[0], strerror(fileout_err));	
+		} else {
+			fprintf(stderr, "%s: Error verify the output file: content hash mismatch\n",
+						argv[optind]);
 		}
 		goto err;
 	}
 
+	if(verbose && info.has_hash) {
+		print_content_hash(&info);
+	}
+	if(verbose) {
+		print_pool_usage();
+	}
+
 	// Free the memory allocated for the decoder. This only needs to be
 	// done after the last file.
 	lzma_end(&strm);
@@ -814,9 +3535,32 @@ decompress_main(int32_t argc, char **argv)
 	}
 	outfile = NULL;
 
+	// only a verified extraction gets here
+	if(NULL != cache_path
+		&& cache_store(cache_dir, cache_path, argv[optind], &info) != 0) {
+		fprintf(stderr, "%s: Error add to the cache: %s\n",
+					cache_path, strerror(errno));
+	}
+
+cached:
+	trace_close();
+	free_archive_info(&info);
+	if(NULL != cache_path) {
+		free(cache_path);
+	}
+	if(NULL != infile) {
+		fclose(infile);
+	}
+	lzma_end(&strm);
+
 	return EXIT_SUCCESS;
 
 err:
+	trace_close();
+	free_archive_info(&info);
+	if(NULL != cache_path) {
+		free(cache_path);
+	}
 	if(NULL != infile) {
 		fclose(infile);
 	}